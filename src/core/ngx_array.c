@@ -46,6 +46,8 @@ void ngx_array_destroy(ngx_array_t *a) {
          * memory pointer", as if the backing array allocation never happened.
          */
 
+        ngx_pool_dirty(p);
+
         p->d.last -= a->size * a->nalloc;
     }
 
@@ -66,6 +68,8 @@ void ngx_array_destroy(ngx_array_t *a) {
          * memory pointer", as if the struture allocation never happened.
          */
 
+        ngx_pool_dirty(p);
+
         p->d.last = (u_char *) a;
     }
 }
@@ -74,7 +78,6 @@ void ngx_array_destroy(ngx_array_t *a) {
 void *ngx_array_push(ngx_array_t *a) {
     void        *elt, *new;
     size_t       size;
-    ngx_pool_t  *p;
 
     if (a->nelts == a->nalloc) {
 
@@ -87,64 +90,48 @@ void *ngx_array_push(ngx_array_t *a) {
          */
         size = a->size * a->nalloc; 
 
-        p = a->pool;
-
-        if ((u_char *) a->elts + size == p->d.last && p->d.last + a->size <= p->d.end) {
+        if (ngx_pextend(a->pool, a->elts, size, size + a->size) == NGX_OK) {
 
             /**
-             * The array allocation is the last in the pool, 
-             * meaning no other allocations happened since 
-             * we've last allocated memory for this array 
-             * from this pool. We enforce this because we 
-             * need a contiguos chunk of memory to store 
-             * the backing array.
-             * And there is space for allocation of at least 
-             * one extra element (the previous allocation was 
-             * made by the pool's "small object allocator", 
-             * and just extending the array past it's current 
-             * bound will not exceed the pool's current chunk 
-             * of memory used for allocating "small objects"). 
+             * The backing array is the last allocation in its pool block, 
+             * meaning no other allocations happened since we've last allocated 
+             * memory for this array from this block, and there is space for 
+             * at least one extra element. The array's bounds were just extended 
+             * in place (`ngx_pextend()` moved the block's `d.last`).
              */
-            p->d.last += a->size; /* just extend the array's bounds so that it can fit another element */
-            a->nalloc++;          /* increment array's capacity by 1 */
+            a->nalloc++; /* increment array's capacity by 1 */
+
         } else {
 
             /**
-             * Allocate a new array, either someone else allocated 
-             * from this same pool since we've last allocated space 
-             * for this array, or there's not enought room left for 
-             * an extra element in the pool's current chunk of memory 
-             * used for allocating "small objects". 
-             */
-
-
-            /** 
-             * Double array's current capacity, this may lead to allocating 
-             * directly from the heap/OS if we hit pool's max size for a 
-             * single allocation (pool's "large object allocator").
+             * Either someone else allocated from this same pool since we've 
+             * last allocated space for this array, or there's not enough room 
+             * left in the block for an extra element: double array's current 
+             * capacity and copy the content over. This may lead to allocating 
+             * directly from the heap/OS if we hit pool's max size for a single 
+             * allocation (pool's "large object allocator"), a previous large 
+             * backing array is given back to the pool by `ngx_prealloc()`.
              */
-            new = ngx_palloc(p, 2 * size); 
+            new = ngx_prealloc(a->pool, a->elts, size, 2 * size);
             if (new == NULL) {
                 return NULL;
             }
 
-            ngx_memcpy(new, a->elts, size); /* copy content over */
             a->elts = new;
-            a->nalloc *= 2;                 /* double capacity */
+            a->nalloc *= 2; /* double capacity */
         }
     }
 
     elt = (u_char *) a->elts + a->size * a->nelts; /* get pointer to next array's free slot */
-    a->nelts; /* increment array's length, caller will store an element via the returned `elt` pointer to array's slot */
+    a->nelts++; /* increment array's length, caller will store an element via the returned `elt` pointer to array's slot */
 
     return elt;
 }
 
 void *ngx_array_push_n(ngx_array_t *a, ngx_uint_t n) {
     void        *elt, *new;
-    size_t       size;
+    size_t       size, old;
     ngx_uint_t   nalloc;
-    ngx_pool_t  *p;
 
     size = n * a->size; /* amount of memory required to store another `n` elements in the array */
 
@@ -155,48 +142,33 @@ void *ngx_array_push_n(ngx_array_t *a, ngx_uint_t n) {
          * will exceed current capacity 
          */
 
-         if ((u_char *) a->elts + size == p->d.last && p->d.last + a->size <= p->d.end) {
+        old = a->size * a->nalloc; /* amount of memory currently taken by the backing array */
+
+        if (ngx_pextend(a->pool, a->elts, old, old + size) == NGX_OK) {
 
             /**
-             * The array allocation is the last in the pool, 
-             * meaning no other allocations happened since 
-             * we've last allocated memory for this array 
-             * from this pool. We enforce this because we 
-             * need a contiguos chunk of memory to store 
-             * the backing array.
-             * And there is space for allocation of at least 
-             * `n` extra elements (the previous allocation was 
-             * made by the pool's "small object allocator", 
-             * and just extending the array past it's current 
-             * bound will not exceed the pool's current chunk 
-             * of memory used for allocating "small objects"). 
+             * The backing array is the last allocation in its pool block 
+             * and there is space for `n` extra elements, the array's bounds 
+             * were just extended in place. 
              */
+            a->nalloc += n; /* update array's capacity */
 
-            p->d.last += size; /* just extend the array's bounds so that it can fit `n` extra elements */
-            a->nalloc += n;    /* updated array's capacity */
         } else {
 
-             /**
+            /**
              * Allocate a new array, either someone else allocated 
              * from this same pool since we've last allocated space 
-             * for this array, or there's not enought room left for 
-             * `n` extra elements in the pool's current chunk of memory 
-             * used for allocating "small objects".
+             * for this array, or there's not enough room left for 
+             * `n` extra elements in the block.
              */
 
             nalloc = 2 * ((n >= a->nalloc) ? n : a->nalloc); /* either double the array's capacity or make it's capacity `2 * n`, whichever is greater */
 
-            /** 
-             * This may lead to allocating directly from the heap/OS 
-             * if we hit pool's max size for a single allocation 
-             * (pool's "large object allocator").
-             */
-            new = ngx_palloc(p, nalloc * a->size);
+            new = ngx_prealloc(a->pool, a->elts, old, nalloc * a->size);
             if (new == NULL) {
                 return NULL;
             }
 
-            ngx_memcpy(new, a->elts, a->nelts * a->size); /* copy content over */
             a->elts = new;
             a->nalloc = nalloc; /* update capacity */
         }
@@ -206,4 +178,4 @@ void *ngx_array_push_n(ngx_array_t *a, ngx_uint_t n) {
     a->nelts += n; /* update array's length */
 
     return elt;
-}
\ No newline at end of file
+}
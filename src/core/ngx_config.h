@@ -11,6 +11,26 @@
 #define NGX_HAVE_SO_SNDLOWAT     1
 #endif
 
+/* SSE2 is part of x86-64, so the compiler tells if it may be used */
+#if !defined(NGX_HAVE_SSE2) && defined(__SSE2__)
+#define NGX_HAVE_SSE2            1
+#endif
+
+/* AVX2 isn't, it takes -mavx2 (or -march= of a CPU which has it) */
+#if !defined(NGX_HAVE_AVX2) && defined(__AVX2__)
+#define NGX_HAVE_AVX2            1
+#endif
+
+/* gcc and clang, a single bsf/tzcnt on x86 */
+#if !defined(NGX_HAVE_BUILTIN_CTZ) && defined(__GNUC__)
+#define NGX_HAVE_BUILTIN_CTZ     1
+#endif
+
+/* gcc and clang, popcnt with -mpopcnt, a bit-twiddling sequence otherwise */
+#if !defined(NGX_HAVE_BUILTIN_POPCOUNT) && defined(__GNUC__)
+#define NGX_HAVE_BUILTIN_POPCOUNT  1
+#endif
+
 #if !(NGX_WIN32)
 
 #define ngx_signal_helper(n)     SIG##n  
@@ -33,8 +33,8 @@ typedef struct ngx_file_s            ngx_file_t;
 #include <ngx_log.h>
 #include <ngx_buf.h>
 #include <ngx_alloc.h>
-#include <ngx_palloc.h>
 #include <ngx_queue.h>
+#include <ngx_palloc.h>
 #include <ngx_array.h>
 #include <ngx_list.h>
 #include <ngx_file.h>
@@ -52,6 +52,7 @@ typedef struct ngx_file_s            ngx_file_t;
 #define CRLF   "\r\n"
 
 
+#define ngx_max(val1, val2) ((val1 < val2) ? (val2) : (val1))
 #define ngx_min(val1, val2) ((val1 > val2) ? (val2) : (val1))
 
 
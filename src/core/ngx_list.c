@@ -31,29 +31,45 @@ void *ngx_list_push(ngx_list_t *l) {
     
     last = l->last;
 
-    if (last->nelts == l->nalloc) {
+    if (last->nelts == last->nalloc) {
 
         /**
-         * length equals capacity, the last part is full, 
-         * allocate a new list part with same capacity and 
-         * a length of zero 
+         * length equals capacity, the last part is full.
+         * 
+         * If its backing array is still the last allocation in its pool 
+         * block, grow it in place by another `nalloc` elements. Elements 
+         * never move, so pointers handed out by previous pushes stay valid, 
+         * which is why there's no allocate-and-copy fallback here 
+         * (`ngx_prealloc()`), the fallback is a new part.
          */
 
-        last = ngx_palloc(l->pool, sizeof(ngx_list_part_t));
-        if (last == NULL) {
-            return NULL;
-        }
+        if (ngx_pextend(l->pool, last->elts, last->nalloc * l->size, (last->nalloc + l->nalloc) * l->size) == NGX_OK) {
+            last->nalloc += l->nalloc;
 
-        last->elts = ngx_palloc(l->pool, l->nalloc * l->size);
-        if (last->elts == NULL) {
-            return NULL;
-        }
+        } else {
+
+            /**
+             * allocate a new list part with same initial capacity 
+             * and a length of zero 
+             */
 
-        last->nelts = 0;
-        last->next = NULL;
+            last = ngx_palloc(l->pool, sizeof(ngx_list_part_t));
+            if (last == NULL) {
+                return NULL;
+            }
 
-        l->last->next = last;
-        l->last = last;
+            last->elts = ngx_palloc(l->pool, l->nalloc * l->size);
+            if (last->elts == NULL) {
+                return NULL;
+            }
+
+            last->nelts = 0;
+            last->nalloc = l->nalloc;
+            last->next = NULL;
+
+            l->last->next = last;
+            l->last = last;
+        }
     }
 
     elt = (char *) last->elts + l->size * last->nelts; /* get next element pointer */
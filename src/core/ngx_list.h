@@ -11,6 +11,7 @@ typedef struct ngx_list_part_s  ngx_list_part_t;
 struct ngx_list_part_s {
     void             *elts;  /* list part backing array */
     ngx_uint_t        nelts; /* list part length */
+    ngx_uint_t        nalloc; /* list part capacity, starts at list's `nalloc` and may grow in place */
     ngx_list_part_t  *next;  /* pointer to next list part in singly-linked list of parts */
 };
 
@@ -19,7 +20,7 @@ typedef struct {
     ngx_list_part_t  *last;   /* last part in possible singly-linked list of parts, also the current parent for append operations */
     ngx_list_part_t   part;   /* first part in possible singly-linked list of parts */
     size_t            size;   /* list element size */
-    ngx_uint_t        nalloc; /* capacity of a single list part */
+    ngx_uint_t        nalloc; /* initial capacity of a single list part, also the step it grows by */
     ngx_pool_t       *pool;   /* pool, from which the list, all of it's parts and part backing arrays are allocated */
 } ngx_list_t;
 
@@ -34,6 +35,7 @@ static ngx_inline ngx_int_t ngx_list_init(ngx_list_t *list, ngx_pool_t *pool, ng
     }
 
     list->part.nelts = 0;     /* list part length */
+    list->part.nalloc = n;    /* list part capacity */
     list->part.next = NULL;   /* start from a single part */
     list->last = &list->part; /* last part in singly-linked list of parts and also the current part for append operations */
     list->size = size;        /* list element size */
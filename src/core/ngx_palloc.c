@@ -1,13 +1,131 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 
+#if (NGX_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
+
+static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size, ngx_uint_t align, ngx_uint_t zero);
+static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static void *ngx_palloc_block(ngx_pool_t *pool, size_t size, ngx_uint_t zero);
+static void ngx_pool_init(ngx_pool_t *p, size_t size, ngx_uint_t site, ngx_log_t *log);
+static void *ngx_pool_block_alloc(size_t size, ngx_log_t *log);
+static void *ngx_pool_block_heap(size_t size, ngx_log_t *log);
+static void ngx_pool_block_free(void *block, size_t size);
+static void ngx_pool_cache_trim(ngx_uint_t n);
+static void ngx_pool_block_release(void *block);
+static void ngx_pool_zero_stream(u_char *start, u_char *end);
+static void *ngx_pool_arena_alloc(ngx_log_t *log);
+static void ngx_pool_arena_free(void *block);
+static void ngx_pool_site_sample(ngx_pool_t *pool);
+static void ngx_pool_rewind(ngx_pool_t *pool, ngx_uint_t keep);
+static void ngx_pool_purge(ngx_pool_t *p, u_char *start, ngx_log_t *log);
+static ngx_uint_t ngx_pool_large_class(size_t size);
+static void ngx_pool_large_link(ngx_pool_t *pool, ngx_pool_large_t *l);
+static void ngx_pool_large_unlink(ngx_pool_t *pool, ngx_pool_large_t *l);
+static void ngx_pool_large_free(ngx_pool_t *pool, ngx_pool_large_t *l);
+static void ngx_pool_large_flush(ngx_pool_t *pool);
+static void ngx_pool_cleanup_unlink(ngx_pool_t *pool, ngx_pool_cleanup_t *c);
+#if (NGX_THREADS)
+static ngx_pool_t *ngx_pool_thread(ngx_pool_t *pool);
+static void ngx_pool_thread_flush(ngx_pool_t *pool);
+#endif
+
+
+/*
+ * Size of the node in front of the data of a cleanup allocated in one 
+ * go, rounded up so that the data keeps the pool's word alignment.
+ */
+#define NGX_POOL_CLEANUP_HSIZE ngx_align(sizeof(ngx_pool_cleanup_t), NGX_ALIGMENT)
+
+
+/*
+ * Size of the in-band node in front of large allocations, rounded up 
+ * so that the memory after it keeps malloc(3)'s 16-byte alignment.
+ */
+#define NGX_POOL_LARGE_HSIZE   ngx_align(sizeof(ngx_pool_large_t), NGX_POOL_ALIGNMENT)
+
+
+/**
+ * Per-worker cache of pool blocks. Workers are separate processes, 
+ * so a plain global is already "per-worker" and needs no locking.
+ * Blocks cached by the master before fork() are simply duplicated 
+ * into every worker (copy-on-write).
+ */
+ngx_pool_cache_t  ngx_pool_cache = {
+    NULL, 0, NGX_DEFAULT_POOL_SIZE, NGX_POOL_CACHE_LOW, NGX_POOL_CACHE_HIGH,
+    0, 0, 0, 0, 0,
+    0, 0, { NULL, NULL }, 0, 0
+};
+
+
+/* per-worker usage histograms of tagged pools, indexed by call-site id */
+ngx_pool_site_t  ngx_pool_sites[NGX_POOL_SITES];
+
+
+#if (NGX_HAVE_NUMA)
+
+/*
+ * Every NGX_POOL_NUMA_SAMPLE-th block taken from or given back to the heap 
+ * has its placement looked up, see `ngx_numa_sample()`.
+ */
+#define NGX_POOL_NUMA_SAMPLE   16
+
+static ngx_uint_t  ngx_pool_numa_blocks;
+
+#endif
+
+
+#if (NGX_THREADS)
+
+/**
+ * Every thread remembers the sub-pool it got from the thread-safe pool it 
+ * has allocated from last, keyed by the pool's serial rather than its address, 
+ * as the address may be reused by a new pool once the old one is destroyed. 
+ * Serials are never reused, so a stale entry simply never matches.
+ */
+static ngx_atomic_t            ngx_pool_thread_serials;
+static __thread ngx_uint_t     ngx_pool_thread_serial;
+static __thread ngx_pool_t    *ngx_pool_thread_pool;
+
+
+/**
+ * Thread-safe pools are switched over to the calling thread's sub-pool 
+ * first. The fast path is a compare against the thread-local serial, 
+ * no locks and no atomics. Yields the sub-pool, NULL if it couldn't be 
+ * created; only for pools with a `serial`.
+ */
+#define ngx_pool_thread_get(pool)                                             \
+    ((ngx_pool_thread_serial == (pool)->serial)                               \
+     ? ngx_pool_thread_pool : ngx_pool_thread(pool))
 
-static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
+#endif
 
 
 ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log) {
+    return ngx_create_pool_tagged(size, NGX_POOL_SITE_NONE, log);
+}
+
+
+/**
+ * ngx_create_pool_tagged creates a pool tagged with a call-site id. Once 
+ * enough pools from the same site were destroyed, the size passed in by 
+ * the caller is replaced by the size picked from the site's usage histogram 
+ * (see `ngx_pool_site_sample()`), so that the common case fits into the 
+ * first block and `ngx_palloc_block()` never has to chain another one.
+ */
+ngx_pool_t *ngx_create_pool_tagged(size_t size, ngx_uint_t site, ngx_log_t *log) {
     ngx_pool_t  *p;
 
+    if (site >= NGX_POOL_SITES) {
+        site = NGX_POOL_SITE_NONE;
+    }
+
+    if (site != NGX_POOL_SITE_NONE && ngx_pool_sites[site].size) {
+        size = ngx_pool_sites[site].size;
+    }
+
     /**
      * Allocates `size` bytes and returns the address of the allocated memory.
      * The address of the allocated memory will be a multiple of alignment, 
@@ -25,12 +143,23 @@ ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log) {
      * Will normally allocate a block from the heap, like malloc, whereas mmap will always go to the operating system.
      * 
      * If size is 0, then the value returned is either NULL or a unique pointer value.
+     * 
+     * Blocks of the cached size are popped from the per-worker block cache 
+     * first (see `ngx_pool_block_alloc()`).
      */
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    p = ngx_pool_block_alloc(size, log);
     if (p == NULL) {
         return NULL;
     }
 
+    ngx_pool_init(p, size, site, log);
+
+    return p;
+}
+
+
+/* sets up the header of the first block of a pool */
+static void ngx_pool_init(ngx_pool_t *p, size_t size, ngx_uint_t site, ngx_log_t *log) {
     p->d.last = (u_char *) p + sizeof(ngx_pool_t); /* TODO!!!!! address of last byte of `ngx_pool_t` fields to which this `ngx_pool_data_t` belongs? After this address start a chunk of free memory belonging to this pool? */
     p->d.end = (u_char *) p + size; /* TODO!!!!! address of last byte of memory allocated by this pool? */
     p->d.next = NULL; /* TODO!!!!! */
@@ -43,21 +172,155 @@ ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log) {
     p->current = p; /* TODO!!!!! */
     p->chain = NULL; /* TODO!!!!! */
     p->large = NULL; /* TODO!!!!! */
+    ngx_memzero(p->cached, sizeof(p->cached));
     p->cleanup = NULL; /* TODO!!!!! */
+    p->free_slots = (1 << NGX_POOL_CLEANUP_SLOTS) - 1;
     p->log = log;
+    p->site = site;
+    p->mark = NULL;
+    p->keep = 0;
+    p->trim = 0;
+
+#if (NGX_THREADS)
+    p->threads = NULL;
+    p->serial = 0;
+    p->owner = 0;
+    p->parent = NULL;
+#endif
+}
+
+
+#if (NGX_THREADS)
+
+/**
+ * ngx_create_pool_mt creates a pool which may be allocated from by any number 
+ * of threads at once. The creating thread (the owner) allocates from the pool 
+ * itself, any other thread gets a sub-pool of its own on its first allocation 
+ * (see `ngx_pool_thread()`), a private bump region chained into the owner's 
+ * list, so `ngx_palloc_small()` needs no locks. Sub-pools take their blocks 
+ * straight from the heap and give them straight back to it, as the per-worker 
+ * block cache and arenas aren't thread-safe.
+ * 
+ * Only `ngx_palloc()`, `ngx_pnalloc()`, `ngx_pcalloc()`, `ngx_pmemalign()` 
+ * and `ngx_pfree()` (of the calling thread's own allocations) are thread-safe. 
+ * Everything else, cleanups, checkpoints, resizing, resetting and destroying 
+ * the pool, is done by the owner once the other threads are done with it. 
+ * Destroying the pool destroys every sub-pool along with it.
+ */
+ngx_pool_t *ngx_create_pool_mt(size_t size, ngx_log_t *log) {
+    ngx_pool_t  *p;
+
+    p = ngx_create_pool(size, log);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    p->serial = ngx_atomic_fetch_add(&ngx_pool_thread_serials, 1) + 1;
+    p->owner = ngx_thread_tid();
+
+    return p;
+}
+
+
+/**
+ * ngx_pool_thread is the slow path of `ngx_pool_thread_get()`: it finds the 
+ * calling thread's sub-pool in the pool's list, or creates one and pushes it 
+ * onto the list with a compare-and-swap. Only the thread itself ever adds its 
+ * entry, and entries are only removed by the owner once no one allocates, so 
+ * a lock-free push is all it takes. The result is remembered thread-locally.
+ */
+static ngx_pool_t *ngx_pool_thread(ngx_pool_t *pool) {
+    size_t              size;
+    ngx_tid_t           tid;
+    ngx_pool_t         *p;
+    ngx_pool_thread_t  *t;
+
+    tid = ngx_thread_tid();
+
+    if (tid == pool->owner) {
+        p = pool;
+        goto found;
+    }
+
+    for (t = pool->threads; t; t = t->next) {
+        if (t->tid == tid) {
+            p = t->pool;
+            goto found;
+        }
+    }
+
+    size = (size_t) (pool->d.end - (u_char *) pool);
+
+    p = ngx_pool_block_heap(size, pool->log);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    ngx_pool_init(p, size, NGX_POOL_SITE_NONE, pool->log);
+
+    p->owner = tid;
+    p->parent = pool;
+
+    t = ngx_palloc(p, sizeof(ngx_pool_thread_t));
+    if (t == NULL) {
+        ngx_destroy_pool(p);
+        return NULL;
+    }
+
+    t->tid = tid;
+    t->pool = p;
+
+    do {
+        t->next = pool->threads;
+    } while (!ngx_atomic_cmp_set((ngx_atomic_t *) &pool->threads, 
+                                 (ngx_atomic_uint_t) t->next, (ngx_atomic_uint_t) t));
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "pool thread: %p, tid: " NGX_TID_T_FMT, p, tid);
+
+found:
+
+    ngx_pool_thread_serial = pool->serial;
+    ngx_pool_thread_pool = p;
 
     return p;
 }
 
 
+/**
+ * ngx_pool_thread_flush destroys all sub-pools of a thread-safe pool, their 
+ * cleanups are run by `ngx_destroy_pool()` as usual. The pool gets a new serial, 
+ * so sub-pools remembered by threads are never looked at again. Called by the 
+ * owner only.
+ */
+static void ngx_pool_thread_flush(ngx_pool_t *pool) {
+    ngx_pool_thread_t  *t, *next;
+
+    for (t = pool->threads; t; t = next) {
+        next = t->next; /* the entry lives in the sub-pool */
+        ngx_destroy_pool(t->pool);
+    }
+
+    pool->threads = NULL;
+    pool->serial = ngx_atomic_fetch_add(&ngx_pool_thread_serials, 1) + 1;
+}
+
+#endif
+
+
 /**
  * 
  */
 void ngx_destroy_pool(ngx_pool_t *pool) {
     ngx_pool_t          *p, *n;
-    ngx_pool_large_t    *l;
+    ngx_pool_large_t    *l, *ln;
     ngx_pool_cleanup_t  *c;
 
+#if (NGX_THREADS)
+    if (pool->serial) {
+        ngx_pool_thread_flush(pool);
+    }
+#endif
+
     /**
      * TODO!!!!! add more details.
      * Cycle through "main" pool's singly-linked list of pointers to `ngx_pool_cleanup_t` structs, 
@@ -73,6 +336,9 @@ void ngx_destroy_pool(ngx_pool_t *pool) {
         }
     }
 
+    /* the whole block chain is still intact, record how much of it was used */
+    ngx_pool_site_sample(pool);
+
 #if (NGX_DEBUG)
 
     /**
@@ -96,22 +362,38 @@ void ngx_destroy_pool(ngx_pool_t *pool) {
 #endif 
 
     /**
-     * Free all chunks of memory owned by the singly-linked list of `ngx_pool_large_t` structs (some of these 
-     * structures may have their associated chunks freed already by manually calling `ngx_pfree()`).
+     * Free all chunks of memory owned by the list of `ngx_pool_large_t` structs and the 
+     * ones kept for reuse. Nodes live in-band within those chunks, so the next node is 
+     * read before the current one is free()d. Chunks freed by `ngx_pfree()` were already 
+     * unlinked.
      */
-    for (l = pool->large; l; l = l->next) {
-        if (l->alloc) {
-            ngx_free(l->alloc);
-        }
+    for (l = pool->large; l; l = ln) {
+        ln = l->next;
+        ngx_free(l->start);
     }
 
+    ngx_pool_large_flush(pool);
+
     /**
      * Free the "main" pool and its singly-linked list of pools (`ngx_pool_t` structures),
      * which will also clean up any `ngx_pool_large_t` or `ngx_pool_cleanup_t` structures
      * associated with this pool, because they were allocated from this same pool (small allocations).
+     * 
+     * Every block knows its own size through `d.end`, blocks of the cached size 
+     * go back to the per-worker block cache instead of free(3). The next block 
+     * is read by the loop before the current one is handed over. 
+     * 
+     * Blocks of a thread's sub-pool came straight from the heap, and the sub-pool 
+     * may be destroyed on a thread other than the one running the worker's event 
+     * loop, so they bypass the block cache, which isn't thread-safe.
      */
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(pool);
+#if (NGX_THREADS)
+        if (pool->parent) {
+            ngx_free(p);
+        } else
+#endif
+        ngx_pool_block_free(p, (size_t) (p->d.end - (u_char *) p));
         
         if (n == NULL) {
             break;
@@ -121,31 +403,277 @@ void ngx_destroy_pool(ngx_pool_t *pool) {
 
 
 void ngx_reset_pool(ngx_pool_t *pool) {
-    ngx_pool_t        *p;
-    ngx_pool_large_t  *l;
+    ngx_pool_t  *p;
+    ngx_uint_t   n;
+
+    /**
+     * A reset ends a "usage period" of the pool just like destruction 
+     * does (think keepalive connections), so sample it before rewinding.
+     */
+    ngx_pool_site_sample(pool);
+
+    if (pool->trim) {
+
+        for (n = 0, p = pool; p; p = p->d.next) {
+            n++;
+        }
 
-    for (l = pool->large; l; l = l->next) { 
-        if(l->alloc) {
-            ngx_free(l->alloc);
+        if (n > pool->trim) {
+            /* the pool has grown past its high-water mark, e.g. after one huge request */
+            ngx_pool_rewind(pool, pool->keep ? pool->keep : 1);
+            return;
         }
     }
 
-    for (p = pool; p; p = p->d.next) {
+    ngx_pool_rewind(pool, 0);
+}
+
+
+/**
+ * ngx_reset_pool_trim resets the pool like `ngx_reset_pool()` does, but also 
+ * trims its chain down to `keep` blocks (at least the main one) and gives the 
+ * memory beyond `d.last` of the kept blocks back to the kernel. Meant for pools 
+ * going idle for a long time, e.g. keepalive connections, which would otherwise 
+ * keep the footprint of the biggest request they've ever served.
+ */
+void ngx_reset_pool_trim(ngx_pool_t *pool, ngx_uint_t keep) {
+    ngx_pool_site_sample(pool);
+    ngx_pool_rewind(pool, keep ? keep : 1);
+}
+
+
+/**
+ * ngx_pool_set_trim sets up the pool's high-water mark: once its chain has 
+ * grown past `trim` blocks, `ngx_reset_pool()` trims it down to `keep` blocks, 
+ * as `ngx_reset_pool_trim()` would. A zero `trim` turns that off.
+ */
+void ngx_pool_set_trim(ngx_pool_t *pool, ngx_uint_t keep, ngx_uint_t trim) {
+    pool->keep = keep;
+    pool->trim = trim;
+}
+
+
+/**
+ * ngx_pool_rewind frees all large allocations, and rewinds every block's 
+ * `d.last` back to the start of its free space. 
+ * 
+ * With a non-zero `keep` only the first `keep` blocks are kept: blocks past 
+ * them are unlinked, purged (see `ngx_alloc_purge()`) and given back to the 
+ * block cache (or the heap, or their arena). The unused tails of the kept 
+ * blocks are purged as well, arena blocks excepted (see `ngx_pool_purge()`). Pages holding a block's header (and the link 
+ * of a cached block) are never purged, partial pages are left alone anyway.
+ * 
+ * Purging costs a madvise() per block, which is why a plain reset (`keep` 
+ * of 0, used by keepalive connections between requests) never does it.
+ */
+static void ngx_pool_rewind(ngx_pool_t *pool, ngx_uint_t keep) {
+    ngx_uint_t         i;
+    ngx_pool_t        *p, *n, *tail;
+    ngx_pool_large_t  *l, *ln;
+
+#if (NGX_THREADS)
+    if (pool->serial) {
+        ngx_pool_thread_flush(pool); /* threads start over with fresh sub-pools */
+    }
+#endif
+
+    for (l = pool->large; l; l = ln) { 
+        ln = l->next;
+        ngx_free(l->start);
+    }
+
+    ngx_pool_large_flush(pool); /* an idle pool shouldn't keep large chunks around */
+
+    tail = NULL;
+
+    for (p = pool, i = 0; p; p = n, i++) {
+        n = p->d.next;
+
+        ngx_pool_dirty(p);
+
+        if (keep && i >= keep) {
+            p->d.last = (u_char *) p + sizeof(ngx_pool_t);
+            ngx_pool_purge(p, p->d.last, pool->log);
+            ngx_pool_block_free(p, (size_t) (p->d.end - (u_char *) p));
+            continue;
+        }
+
         p->d.last = (u_char *) p + sizeof(ngx_pool_t); /* why isn't (u_char *) p + sizeof(ngx_pool_data_t)?  */
         p->d.failed = 0;
+
+        if (keep) {
+            ngx_pool_purge(p, p->d.last, pool->log);
+        }
+
+        tail = p;
     }
 
+    tail->d.next = NULL;
+
     pool->current = pool;
     pool->chain = NULL;
-    pool->large = NULL; /* since all `ngx_pool_data_t`s were cleared, and `ngx_pool_large_t` reside inside them */
+    pool->large = NULL; /* all large allocations were free()d along with their in-band nodes */
+    pool->mark = NULL;  /* all checkpoints are below the rewound `d.last`s */
+}
+
+
+/**
+ * Purge the pages of the block from `start` up to its end (see `ngx_alloc_purge()`). 
+ * Pages dropped with MADV_DONTNEED read back as zeroes, so the block's known-zero 
+ * watermark can come down to the first purged page; MADV_FREE ones may keep 
+ * their contents. The watermark must already be raised past `d.last`. 
+ * 
+ * Heap blocks are only 16-byte aligned, so their last page is usually a partial 
+ * one, which isn't purged; whatever of it lies below the old watermark is zeroed 
+ * here before the watermark comes down past it.
+ * 
+ * Blocks carved out of an arena are left alone: madvise() fails with EINVAL 
+ * on a part of a hugetlbfs page, and on THP it would split the huge page the 
+ * arena was mapped for. Their memory goes back to the kernel along with the 
+ * whole arena instead (see `ngx_pool_arena_free()`).
+ */
+static void ngx_pool_purge(ngx_pool_t *p, u_char *start, ngx_log_t *log) {
+    u_char  *z;
+#if (NGX_ALLOC_PURGE_ZEROES)
+    u_char  *tail;
+#endif
+
+    if (p->d.arena) {
+        return;
+    }
+
+    z = ngx_alloc_purge(start, p->d.end, log);
+
+#if (NGX_ALLOC_PURGE_ZEROES)
+    if (z < p->d.zero) {
+        tail = (u_char *) ((uintptr_t) p->d.end & ~((uintptr_t) ngx_pagesize - 1));
+
+        if (tail < p->d.zero) {
+            ngx_memzero(tail, p->d.zero - tail);
+        }
+
+        p->d.zero = z;
+    }
+#else
+    (void) z;
+#endif
+}
+
+
+/**
+ * ngx_pool_mark takes a checkpoint of the pool, which can later be 
+ * rewound to by `ngx_pool_release()`. 
+ * 
+ * Small allocations may be served by any block from `pool->current` 
+ * to the tail of the chain, so remembering a single `d.last` wouldn't 
+ * be enough to rewind them. Instead, while a checkpoint is active, the 
+ * tail block becomes the `current` one: everything allocated after 
+ * the mark lands either in the tail block above the remembered `d.last` 
+ * or in blocks chained after it. Free space left in blocks between the 
+ * old `current` and the tail is skipped until the checkpoint is released.
+ * 
+ * The `mark` itself should live on the caller's stack (or be allocated 
+ * from the pool before the call).
+ */
+void ngx_pool_mark(ngx_pool_t *pool, ngx_pool_mark_t *mark) {
+    ngx_pool_t  *p;
+
+    for (p = pool->current; p->d.next; p = p->d.next) { /* void */ }
+
+    mark->current = pool->current;
+    mark->block = p;
+    mark->last = p->d.last;
+    mark->large = pool->large;
+    mark->cleanup = pool->cleanup;
+    mark->chain = pool->chain;
+    mark->prev = pool->mark;
+
+    pool->current = p;
+    pool->mark = mark;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "pool mark: %p, last: %p", mark, mark->last);
+}
+
+
+/**
+ * ngx_pool_release rewinds the pool to the checkpoint taken by `ngx_pool_mark()`:
+ *   - cleanup handlers registered after the mark are run (newest first, 
+ *     as `ngx_destroy_pool()` would) and unlinked;
+ *   - large allocations made after the mark are freed, they're inserted 
+ *     at the head of the list, so that's everything in front of the 
+ *     remembered head;
+ *   - blocks chained after the mark go back to the block cache and the 
+ *     tail block's `d.last` is rewound;
+ *   - `current` and the free chain links list are restored.
+ * 
+ * The list nodes themselves were small allocations made after the mark, 
+ * so they must be walked before the blocks are rewound.
+ */
+void ngx_pool_release(ngx_pool_t *pool, ngx_pool_mark_t *mark) {
+    ngx_pool_t          *p, *n;
+    ngx_pool_large_t    *l, *ln;
+    ngx_pool_cleanup_t  *c;
+
+    for (c = pool->cleanup; c != mark->cleanup; c = c->next) {
+        if (c->handler) {
+            ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "run cleanup: %p", c);
+            c->handler(c->data);
+        }
+
+        if (c->embedded) {
+            pool->free_slots |= (ngx_uint_t) 1 << (c - pool->slots);
+        }
+    }
+
+    pool->cleanup = mark->cleanup;
+
+    if (pool->cleanup) {
+        pool->cleanup->prev = &pool->cleanup;
+    }
+
+    /**
+     * `ngx_pfree()` of the remembered head moves `mark->large` to the next 
+     * older node (see `ngx_pool_large_unlink()`), so the remembered head is 
+     * always still linked. Released chunks go through the same path as 
+     * `ngx_pfree()` and may be kept for reuse.
+     */
+    for (l = pool->large; l != mark->large; l = ln) {
+        ln = l->next;
+        ngx_pool_large_free(pool, l);
+    }
+
+    for (p = mark->block->d.next; p; p = n) {
+        n = p->d.next;
+        ngx_pool_block_free(p, (size_t) (p->d.end - (u_char *) p));
+    }
+
+    ngx_pool_dirty(mark->block);
+
+    mark->block->d.next = NULL;
+    mark->block->d.last = mark->last;
+
+    pool->current = mark->current;
+    pool->chain = mark->chain;
+    pool->mark = mark->prev;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "pool release: %p", mark);
 }
 
 
 /* ngx_palloc if allocation is less than or equal `pool->max`, allocates via small object allocater and aligns by word-size  */
 void *ngx_palloc(ngx_pool_t *pool, size_t size) {
+#if (NGX_THREADS)
+    if (pool->serial) {
+        pool = ngx_pool_thread_get(pool);
+        if (pool == NULL) {
+            return NULL;
+        }
+    }
+#endif
+
 #if !(NGX_DEBUG_PALLOC)
     if (size <= pool->max) {
-        return ngx_palloc_small(pool, size, 1); /* word-size aligned */
+        return ngx_palloc_small(pool, size, 1, 0); /* word-size aligned */
     }
 #endif
 
@@ -155,9 +683,18 @@ void *ngx_palloc(ngx_pool_t *pool, size_t size) {
 
 /* same as ngx_palloc, but doesn't do word-size aligning for small allocations  */
 void *ngx_pnalloc(ngx_pool_t *pool, size_t size) {
+#if (NGX_THREADS)
+    if (pool->serial) {
+        pool = ngx_pool_thread_get(pool);
+        if (pool == NULL) {
+            return NULL;
+        }
+    }
+#endif
+
 #if !(NGX_DEBUG_PALLOC)
     if (size <= pool->max) {
-        return ngx_palloc_small(pool, size, 0);
+        return ngx_palloc_small(pool, size, 0, 0);
     }
 #endif
 
@@ -170,8 +707,11 @@ void *ngx_pnalloc(ngx_pool_t *pool, size_t size) {
  * chunks, the size of which is specified at "main" pool instantiation time (`ngx_create_pool()`), but 
  * can only fulfill allocation requests, that are less than or equal to "main" pool's `max` attribute, 
  * which is itself equal to pool's size or 4KB at max.
+ * 
+ * With `zero` set the allocation is returned zeroed, but only the part of it 
+ * below the block's known-zero watermark actually has to be memset.
  */
-static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size, ngx_uint_t align) {
+static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size, ngx_uint_t align, ngx_uint_t zero) {
     u_char      *m;
     ngx_pool_t  *p;
 
@@ -198,6 +738,10 @@ static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size, ngx_uint
             /* if there's enough space in pool's memory chunk to fulfill the allocation request*/
             p->d.last = m + size; /* the alloction itself, just move pointer up by the requested size */
 
+            if (zero && p->d.zero > m) {
+                ngx_memzero(m, ngx_min(p->d.zero, p->d.last) - m);
+            }
+
             return m; /* return pointer to the start of the allocated memory chunk */
         }
 
@@ -218,7 +762,7 @@ static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size, ngx_uint
      * serving allocations from memory position just after
      * the embedded `ngx_pool_data_t` struct.
      */
-    return ngx_palloc_block(pool, size);
+    return ngx_palloc_block(pool, size, zero);
 }
 
 
@@ -230,7 +774,7 @@ static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size, ngx_uint
  * serve more than 4 allocation requests, (4) and serves the current allocation 
  * request from the newly instantiated pool.
  */
-static void *ngx_palloc_block(ngx_pool_t *pool, size_t size) {
+static void *ngx_palloc_block(ngx_pool_t *pool, size_t size, ngx_uint_t zero) {
     u_char      *m;       
     size_t       psize;    
     ngx_pool_t  *p, *new; 
@@ -278,7 +822,12 @@ static void *ngx_palloc_block(ngx_pool_t *pool, size_t size) {
      * 
      * If size is 0, then the value returned is either NULL or a unique pointer value.
      */
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log); /* allocate memory for new pool's embedded `ngx_pool_data_t` struct and the rest will be used to fulfill allocation requests */
+#if (NGX_THREADS)
+    if (pool->parent) {
+        m = ngx_pool_block_heap(psize, pool->log); /* sub-pools allocate on other threads, the block cache isn't thread-safe */
+    } else
+#endif
+    m = ngx_pool_block_alloc(psize, pool->log); /* allocate memory for new pool's embedded `ngx_pool_data_t` struct and the rest will be used to fulfill allocation requests */
     if (m == NULL) {
         return NULL;
     }
@@ -298,6 +847,10 @@ static void *ngx_palloc_block(ngx_pool_t *pool, size_t size) {
     m = ngx_align_ptr(m, NGX_ALIGMENT); /* align by machine word size, we cannot trust `ngx_pool_data_t` to be word-size aligned (although it is on 64-bit systems) */
     new->d.last = m + size; /* fulfill allocation request overriding other metadata attributes, next allocation will start at `new->d.last` position */
 
+    if (zero && new->d.zero > m) {
+        ngx_memzero(m, ngx_min(new->d.zero, new->d.last) - m);
+    }
+
     /**
      * This function is called when the current pool isn't
      * able to fulfill a given allocation request, because
@@ -321,115 +874,839 @@ static void *ngx_palloc_block(ngx_pool_t *pool, size_t size) {
    
 
 /**
- * TODO!!!!! ngx_palloc_large - for allocations greater than pool's max size which is at most 4KB?
- * Linked list of `ngx_pool_large_t`s? 
- * Each containing a slab of memory greater than 4KB directly allocated 
- * from the heap/OS via malloc and a link to next `ngx_pool_large_t` in the list?
+ * ngx_pool_block_alloc serves pool blocks of the cached size from the top 
+ * of the per-worker block cache, then (in arena mode) from a huge-page arena. 
+ * Everything else, cache misses outside of arena mode and arenas which 
+ * couldn't be mapped included, goes to `ngx_memalign()`. Cached and arena 
+ * blocks are at least 16-byte aligned, so they can be handed out as is.
  * 
- * Tail is always with a NULL pointer in `.alloc` attribute?
-*/
-static void *ngx_palloc_large(ngx_pool_t *pool, size_t size) {
-    void              *p; /* TODO!!!!! */
-    ngx_uint_t         n;
-    ngx_pool_large_t  *large;
+ * Where the block came from is remembered in its own `d.arena`, which callers 
+ * don't touch, and which a cached block keeps (the cache only reuses the 
+ * block's first word). The same goes for `d.zero`: blocks never handed out 
+ * by an arena are fresh zero pages, recycled ones carry the watermark they 
+ * were given back with, heap blocks are assumed dirty.
+ */
+static void *ngx_pool_block_alloc(size_t size, ngx_log_t *log) {
+    ngx_pool_t              *p;
+    ngx_pool_cache_block_t  *b;
 
-    p = ngx_alloc(size, pool->log); /* malloc with some logging added */
-    if (p == NULL) {
-        return NULL;
-    }
+    if (size == ngx_pool_cache.size) {
 
-    /**
-     * Iterate through "main" pool's singly-linked list of `ngx_pool_large_t` 
-     * structure's
-     */
-    for (large = pool->large; large; large = large->next) {
-        if (large->alloc == NULL) {
+        b = ngx_pool_cache.free;
 
-            /**
-             * TODO!!!!! found at least within the 1st 4 elements of the list a `ngx_pool_large_t` 
-             * without any chunk of memory associated with it, 
-             * make it own the just allocated slab and return a pointer to the start of that slab 
-             */ 
+        if (b) {
+            ngx_pool_cache.free = b->next;
+            ngx_pool_cache.nfree--;
+            ngx_pool_cache.hits++;
 
-            large->alloc = p;
-            return p;
+            ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0, "pool cache get: %p, cached: %ui", b, ngx_pool_cache.nfree);
+
+            return b;
         }
 
-        if (n++ > 3) { /* try finding an `ngx_pool_large_t` with no memory associated with it within only the first 4 elements of the linked list */
-            break;
+        ngx_pool_cache.misses++;
+
+        if (ngx_pool_cache.arena) {
+            p = ngx_pool_arena_alloc(log);
+
+            if (p) {
+                p->d.arena = 1;
+                return p;
+            }
         }
     }
 
-    /**
-     * All first 4 `ngx_pool_large_t`s within the linked list have memory already associated with them, 
-     * allocate a new one via pool's small object allocator (word aligned),
-     * associate the just allocated slab of memory with it and insert it at the head of the list.
-     */
+    return ngx_pool_block_heap(size, log);
+}
 
-    large = ngx_palloc_small(pool, sizeof(ngx_pool_large_t), 1);
-    if (large == NULL) {
-        ngx_free(p); /* just a macro alias for `free` */
-        return NULL;
-    }
 
-    large->alloc = p;
-    large->next = pool->large;
-    pool->large = large;
+/* a block straight from the heap, bypassing the block cache */
+static void *ngx_pool_block_heap(size_t size, ngx_log_t *log) {
+    ngx_pool_t  *p;
+
+    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+
+    if (p) {
+        p->d.zero = (u_char *) p + size; /* nothing is known about heap memory */
+        p->d.arena = 0;
+
+#if (NGX_HAVE_NUMA)
+        if (ngx_pool_numa_blocks++ % NGX_POOL_NUMA_SAMPLE == 0) {
+            ngx_numa_sample(p);
+        }
+#endif
+    }
 
     return p;
 }
 
 
 /**
- * same as ngx_palloc_large, but allocates slab via posix_memalign aligned to alignment, 
- * and always allocates a new `ngx_pool_large_t` to associate the allocated slab with it,
- * and inserts it at the head of the linked list
+ * ngx_pool_block_free pushes blocks of the cached size onto the per-worker 
+ * block cache. If the stack has already reached its high watermark it's 
+ * first trimmed down to the low one, so that a burst of pool destructions 
+ * doesn't turn into a free(3) per block once the cache is full.
+ * 
+ * Blocks of any other size (or all blocks if the cache is disabled by a 
+ * zero high watermark) are released right away.
+ * 
+ * With `ngx_pool_cache.zero` set, the used part of a block is zeroed on its 
+ * way into the cache, everything past its header, so the next pool to get it 
+ * serves `ngx_pcalloc()` without a memset. That's done with non-temporal 
+ * stores: the block is going cold anyway and shouldn't evict hot cache lines.
+ */
+static void ngx_pool_block_free(void *block, size_t size) {
+    u_char                  *start;
+    ngx_pool_t              *p;
+    ngx_pool_cache_block_t  *b;
+
+    p = block;
+
+    ngx_pool_dirty(p); /* `d.last` is about to be overwritten by the stack link */
+
+    if (size != ngx_pool_cache.size || ngx_pool_cache.high == 0) {
+        ngx_pool_block_release(block);
+        return;
+    }
+
+    if (ngx_pool_cache.nfree >= ngx_pool_cache.high) {
+        ngx_pool_cache_trim(ngx_pool_cache.low ? ngx_pool_cache.low - 1 : 0);
+    }
+
+    start = (u_char *) p + sizeof(ngx_pool_data_t);
+
+    if (ngx_pool_cache.zero && p->d.zero > start) {
+        ngx_pool_zero_stream(start, p->d.zero);
+        ngx_pool_cache.zeroed += p->d.zero - start;
+        p->d.zero = start;
+    }
+
+    b = block;
+    b->next = ngx_pool_cache.free;
+
+    ngx_pool_cache.free = b;
+    ngx_pool_cache.nfree++;
+    ngx_pool_cache.puts++;
+}
+
+
+/* release blocks from the top of the cache until only `n` are left */
+static void ngx_pool_cache_trim(ngx_uint_t n) {
+    ngx_pool_cache_block_t  *b;
+
+    while (ngx_pool_cache.nfree > n) {
+        b = ngx_pool_cache.free;
+        ngx_pool_cache.free = b->next;
+        ngx_pool_cache.nfree--;
+        ngx_pool_cache.trims++;
+
+#if (NGX_HAVE_NUMA)
+        if (ngx_pool_numa_blocks++ % NGX_POOL_NUMA_SAMPLE == 0) {
+            ngx_numa_sample(b);
+        }
+#endif
+
+        ngx_pool_block_release(b);
+    }
+}
+
+
+/* give a block back to where it came from: its arena or the heap */
+static void ngx_pool_block_release(void *block) {
+    if (((ngx_pool_t *) block)->d.arena) {
+        ngx_pool_arena_free(block);
+        return;
+    }
+
+    ngx_free(block);
+}
+
+
+/**
+ * ngx_pool_zero_stream zeroes memory with non-temporal (streaming) stores, 
+ * which write whole cache lines straight to memory, bypassing the caches. 
+ * Unaligned head and tail are zeroed as usual. The closing sfence orders 
+ * the streaming stores before whatever the block is used for next.
+ */
+static void ngx_pool_zero_stream(u_char *start, u_char *end) {
+#if (NGX_HAVE_SSE2)
+    u_char   *p, *last;
+    __m128i   zero;
+
+    p = ngx_align_ptr(start, 16);
+
+    if (p >= end) {
+        ngx_memzero(start, end - start);
+        return;
+    }
+
+    last = (u_char *) ((uintptr_t) end & ~((uintptr_t) 15));
+
+    ngx_memzero(start, p - start);
+
+    zero = _mm_setzero_si128();
+
+    for ( /* void */ ; p < last; p += 16) {
+        _mm_stream_si128((__m128i *) p, zero);
+    }
+
+    ngx_memzero(last, end - last);
+
+    _mm_sfence();
+#else
+    ngx_memzero(start, end - start);
+#endif
+}
+
+
+/**
+ * ngx_pool_arena_alloc carves a block out of the first arena with blocks 
+ * left, preferring blocks given back to it over never touched ones. 
+ * Arenas without blocks left are taken off the queue, so this is O(1). 
+ * If there's no such arena a new one is mapped.
+ */
+static void *ngx_pool_arena_alloc(ngx_log_t *log) {
+    u_char                  *m;
+    ngx_uint_t               huge;
+    ngx_pool_arena_t        *a;
+    ngx_pool_cache_block_t  *b;
+
+    /* arenas carved into blocks of a size used before `ngx_pool_cache_init()` are left to drain */
+
+    while (!ngx_queue_empty(&ngx_pool_cache.arenas)) {
+        a = (ngx_pool_arena_t *) ngx_queue_head(&ngx_pool_cache.arenas);
+
+        if (a->size == ngx_pool_cache.size) {
+            break;
+        }
+
+        ngx_queue_remove(&a->queue);
+        a->queued = 0;
+    }
+
+    if (ngx_queue_empty(&ngx_pool_cache.arenas)) {
+
+        m = ngx_alloc_huge(NGX_POOL_ARENA_SIZE, &huge, log);
+        if (m == NULL) {
+            return NULL;
+        }
+
+        a = (ngx_pool_arena_t *) m;
+
+        a->free = NULL;
+        a->size = ngx_pool_cache.size;
+        a->last = m + a->size; /* the first block is taken by the header */
+        a->end = m + NGX_POOL_ARENA_SIZE - NGX_POOL_ARENA_SIZE % a->size;
+        a->used = 0;
+        a->huge = huge;
+        a->queued = 1;
+
+        ngx_queue_insert_head(&ngx_pool_cache.arenas, &a->queue);
+
+        ngx_pool_cache.narenas++;
+        ngx_pool_cache.nhuge += huge;
+
+#if (NGX_HAVE_NUMA)
+        ngx_numa_sample(a);
+#endif
+
+        ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0, "pool arena: %p, huge: %ui", a, huge);
+    }
+
+    a = (ngx_pool_arena_t *) ngx_queue_head(&ngx_pool_cache.arenas);
+
+    if (a->free) {
+        b = a->free;
+        a->free = b->next;
+
+    } else {
+        b = (ngx_pool_cache_block_t *) a->last;
+        a->last += a->size;
+
+        ((ngx_pool_t *) b)->d.zero = (u_char *) b; /* never touched since mmap() */
+    }
+
+    a->used++;
+
+    if (a->free == NULL && a->last == a->end) {
+        ngx_queue_remove(&a->queue);
+        a->queued = 0;
+    }
+
+    return b;
+}
+
+
+/**
+ * ngx_pool_arena_free gives a block back to its arena, which is found by 
+ * rounding the block address down to the arena size (arenas are mapped 
+ * aligned to their size). 
+ * 
+ * An arena which had no blocks left goes back to the front of the queue. 
+ * An arena with no blocks handed out is unmapped, unless it's the only one, 
+ * so that a worker going idle doesn't keep every arena of its busiest moment.
+ */
+static void ngx_pool_arena_free(void *block) {
+    ngx_pool_arena_t        *a;
+    ngx_pool_cache_block_t  *b;
+
+    a = (ngx_pool_arena_t *) ((uintptr_t) block & ~((uintptr_t) NGX_POOL_ARENA_SIZE - 1));
+
+    b = block;
+    b->next = a->free;
+    a->free = b;
+    a->used--;
+
+    if (!a->queued) {
+        ngx_queue_insert_head(&ngx_pool_cache.arenas, &a->queue);
+        a->queued = 1;
+    }
+
+    if (a->used == 0 && (ngx_pool_cache.narenas > 1 || a->size != ngx_pool_cache.size)) {
+        ngx_queue_remove(&a->queue);
+
+        ngx_pool_cache.narenas--;
+        ngx_pool_cache.nhuge -= a->huge;
+
+        ngx_free_huge(a, NGX_POOL_ARENA_SIZE, ngx_cycle->log);
+    }
+}
+
+
+/**
+ * ngx_pool_arena_init switches the per-worker block cache into arena mode. 
+ * The cached block size must evenly divide the arena size, otherwise the 
+ * mode is declined and blocks keep coming from the heap. Huge pages being 
+ * unavailable isn't an error: each arena falls back to THP, and if an arena 
+ * can't be mapped at all, blocks come from the heap.
+ */
+ngx_int_t ngx_pool_arena_init(ngx_log_t *log) {
+    if (ngx_pool_cache.size < sizeof(ngx_pool_arena_t) || NGX_POOL_ARENA_SIZE % ngx_pool_cache.size) {
+        ngx_log_error(NGX_LOG_WARN, log, 0, "pool block size %uz doesn't fit into pool arenas", ngx_pool_cache.size);
+        return NGX_DECLINED;
+    }
+
+    if (ngx_pool_cache.arenas.next == NULL) {
+        ngx_queue_init(&ngx_pool_cache.arenas);
+    }
+
+    ngx_pool_cache.arena = 1;
+
+    return NGX_OK;
+}
+
+
+/**
+ * ngx_pool_cache_init (re)configures the per-worker block cache: the size 
+ * of blocks it caches and its watermarks. Changing the block size releases 
+ * everything cached so far, as those blocks can no longer be handed out, 
+ * and leaves arena mode if the new size doesn't fit into arenas. 
+ * A zero `high` disables the cache altogether.
+ */
+void ngx_pool_cache_init(size_t size, ngx_uint_t low, ngx_uint_t high) {
+    if (size != ngx_pool_cache.size || high == 0) {
+        ngx_pool_cache_trim(0);
+    }
+
+    if (size < sizeof(ngx_pool_arena_t) || NGX_POOL_ARENA_SIZE % size) {
+        ngx_pool_cache.arena = 0; /* see `ngx_pool_arena_init()` */
+    }
+
+    if (low > high) {
+        low = high;
+    }
+
+    ngx_pool_cache.size = size;
+    ngx_pool_cache.low = low;
+    ngx_pool_cache.high = high;
+
+    ngx_pool_cache_trim(high);
+}
+
+
+/**
+ * ngx_pool_site_sample records usage of a tagged pool (bytes between 
+ * the start of each block and its `d.last`, pool headers included) 
+ * into its site's histogram. 
+ * 
+ * Every NGX_POOL_SITE_SAMPLES pools the site's initial size is re-picked 
+ * as the upper bound of the bucket which covers NGX_POOL_SITE_PERCENTILE 
+ * percent of the sampled pools, and the histogram starts over, so that 
+ * the size follows changes in the workload.
+ */
+static void ngx_pool_site_sample(ngx_pool_t *pool) {
+    size_t            used, size;
+    ngx_uint_t        i, n, blocks;
+    ngx_pool_t       *p;
+    ngx_pool_site_t  *site;
+
+    if (pool->site == NGX_POOL_SITE_NONE) {
+        return;
+    }
+
+    site = &ngx_pool_sites[pool->site];
+
+    used = 0;
+    blocks = 0;
+
+    for (p = pool; p; p = p->d.next) {
+        used += (size_t) (p->d.last - (u_char *) p);
+        blocks++;
+    }
+
+    for (i = 0, size = NGX_POOL_SITE_MIN_SIZE; size < used && i < NGX_POOL_SITE_BUCKETS - 1; size <<= 1, i++) {
+        /* void */
+    }
+
+    site->hist[i]++;
+    site->pools++;
+
+    if (blocks > 1) {
+        site->chained++;
+    }
+
+    if (site->pools < NGX_POOL_SITE_SAMPLES) {
+        return;
+    }
+
+    n = site->pools * NGX_POOL_SITE_PERCENTILE / 100;
+
+    for (i = 0, size = NGX_POOL_SITE_MIN_SIZE; i < NGX_POOL_SITE_BUCKETS - 1; size <<= 1, i++) {
+        if (site->hist[i] >= n) {
+            break;
+        }
+
+        n -= site->hist[i];
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "pool site %ui: size %uz -> %uz, chained: %ui", pool->site, site->size, size, site->chained);
+
+    site->size = size;
+    site->pools = 0;
+    site->chained = 0;
+    ngx_memzero(site->hist, sizeof(site->hist));
+}
+
+
+/**
+ * ngx_pool_stats_json prints the worker's allocator counters as a single 
+ * JSON object into [buf, last), for regression tracking and status pages: 
+ * the block cache, arenas, the initial size picked for every sampled site 
+ * and, on NUMA builds, the worker's node with sampled page placement. 
+ * 
+ * If `pool` isn't NULL its current footprint is added as well: chained blocks, 
+ * bytes handed out, bytes lost to block headers and unused block tails, and 
+ * live large allocations along with their in-band nodes. 
+ * 
+ * Returns the end of the printed text, output is truncated at `last`.
+ */
+u_char *ngx_pool_stats_json(ngx_pool_t *pool, u_char *buf, u_char *last) {
+    size_t             size, used, header, unused, large, lheader;
+    ngx_uint_t         i, n, blocks, nlarge;
+    ngx_pool_t        *p;
+    ngx_pool_large_t  *l;
+
+    buf = ngx_slprintf(buf, last, "{\"cache\":{\"size\":%uz,\"free\":%ui,\"low\":%ui,\"high\":%ui,"
+                       "\"hits\":%ui,\"misses\":%ui,\"puts\":%ui,\"trims\":%ui,\"zeroed\":%ui,"
+                       "\"arenas\":%ui,\"huge\":%ui},",
+                       ngx_pool_cache.size, ngx_pool_cache.nfree, ngx_pool_cache.low, ngx_pool_cache.high,
+                       ngx_pool_cache.hits, ngx_pool_cache.misses, ngx_pool_cache.puts, ngx_pool_cache.trims,
+                       ngx_pool_cache.zeroed, ngx_pool_cache.narenas, ngx_pool_cache.nhuge);
+
+    buf = ngx_slprintf(buf, last, "\"sites\":[");
+
+    for (i = 1, n = 0; i < NGX_POOL_SITES; i++) {
+        if (ngx_pool_sites[i].size == 0 && ngx_pool_sites[i].pools == 0) {
+            continue;
+        }
+
+        buf = ngx_slprintf(buf, last, "%s{\"site\":%ui,\"size\":%uz,\"pools\":%ui,\"chained\":%ui}",
+                           n++ ? "," : "", i, ngx_pool_sites[i].size, 
+                           ngx_pool_sites[i].pools, ngx_pool_sites[i].chained);
+    }
+
+    buf = ngx_slprintf(buf, last, "]");
+
+#if (NGX_HAVE_NUMA)
+    buf = ngx_slprintf(buf, last, ",\"numa\":{\"node\":%i,\"local\":%ui,\"remote\":%ui}",
+                       ngx_numa.node, ngx_numa.local, ngx_numa.remote);
+#endif
+
+    if (pool) {
+        size = used = header = unused = 0;
+
+        for (p = pool, blocks = 0; p; p = p->d.next, blocks++) {
+            n = (p == pool) ? sizeof(ngx_pool_t) : sizeof(ngx_pool_data_t);
+
+            size += p->d.end - (u_char *) p;
+            header += n;
+            used += p->d.last - (u_char *) p - n;
+            unused += p->d.end - p->d.last;
+        }
+
+        large = lheader = 0;
+
+        for (l = pool->large, nlarge = 0; l; l = l->next, nlarge++) {
+            large += l->size;
+            lheader += (u_char *) l->alloc - (u_char *) l->start;
+        }
+
+        buf = ngx_slprintf(buf, last, ",\"pool\":{\"blocks\":%ui,\"size\":%uz,\"used\":%uz,"
+                           "\"header\":%uz,\"unused\":%uz,\"large\":%ui,\"large_size\":%uz,"
+                           "\"large_header\":%uz}",
+                           blocks, size, used, header, unused, nlarge, large, lheader);
+    }
+
+    return ngx_slprintf(buf, last, "}");
+}
+
+
+/**
+ * ngx_palloc_large serves allocations greater than pool's `max` (which is at most 
+ * 4KB) directly from the heap/OS via malloc. 
+ * 
+ * The `ngx_pool_large_t` node is not a small allocation from the pool anymore, it's 
+ * carved in-band from the front of the malloc()ed chunk, so:
+ *   - `ngx_pfree()` finds it from the freed pointer without a list walk (once the 
+ *     pointer is known not to be a small one) and unlinks it from the doubly-linked 
+ *     list of large allocations in O(1);
+ *   - there are no nodes left behind with `alloc == NULL` to scan or to reuse.
+ * 
+ * Chunks previously freed by `ngx_pfree()` are reused from the pool's per-class cache 
+ * when one large enough is kept there: the cache slot of the request's own class is 
+ * checked first (its chunk may still be too small), then the slot of the next class, 
+ * every chunk of which is big enough by construction.
+ */
+static void *ngx_palloc_large(ngx_pool_t *pool, size_t size) {
+    u_char            *m;
+    ngx_uint_t         c, n;
+    ngx_pool_large_t  *large;
+
+    c = ngx_pool_large_class(size);
+
+    for (n = c; n < c + 2 && n < NGX_POOL_LARGE_CLASSES; n++) {
+        large = pool->cached[n];
+
+        if (large && large->size >= size) {
+            pool->cached[n] = NULL;
+            ngx_pool_large_link(pool, large);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "reuse large: %p:%uz", large->alloc, large->size);
+
+            return large->alloc;
+        }
+    }
+
+    m = ngx_alloc(NGX_POOL_LARGE_HSIZE + size, pool->log); /* malloc with some logging added */
+    if (m == NULL) {
+        return NULL;
+    }
+
+    large = ngx_pool_large_node(m + NGX_POOL_LARGE_HSIZE);
+
+    large->alloc = m + NGX_POOL_LARGE_HSIZE;
+    large->start = m;
+    large->size = size;
+
+    ngx_pool_large_link(pool, large);
+
+    return large->alloc;
+}
+
+
+/**
+ * same as ngx_palloc_large, but allocates the chunk via posix_memalign aligned to alignment.
+ * The node is padded up to `alignment` in front of the returned pointer, such chunks (`start` 
+ * isn't right `NGX_POOL_LARGE_HSIZE` bytes in front of `alloc`) are never kept for reuse.
  */
 void *ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment) {
-    void              *p;
+    u_char            *m;
+    size_t             hsize;
     ngx_pool_large_t  *large;
 
-    p = ngx_memalign(alignment, size, pool->log);
-    if (p == NULL) {
+#if (NGX_THREADS)
+    if (pool->serial) {
+        pool = ngx_pool_thread_get(pool);
+        if (pool == NULL) {
+            return NULL;
+        }
+    }
+#endif
+
+    hsize = ngx_align(sizeof(ngx_pool_large_t), alignment);
+
+    m = ngx_memalign(alignment, hsize + size, pool->log);
+    if (m == NULL) {
         return NULL;
     }
 
-    large = ngx_palloc_small(pool, sizeof(ngx_pool_large_t), 1);
-    if (large == NULL) {
-        ngx_free(p);
+    large = ngx_pool_large_node(m + hsize);
+
+    large->alloc = m + hsize;
+    large->start = m;
+    large->size = size;
+
+    ngx_pool_large_link(pool, large);
+
+    return large->alloc;
+}
+
+
+/**
+ * ngx_pextend grows (or shrinks) the allocation at `p` in place, which is only 
+ * possible if it's the most recent small allocation of the block it lives in, 
+ * i.e. it ends right at the block's `d.last`, and the block has enough room 
+ * left. Only blocks from `pool->current` onwards are looked at, those are the 
+ * only ones small allocations are still served from.
+ * 
+ * An allocation made before the innermost checkpoint (`ngx_pool_mark()`) may 
+ * end right at the remembered `d.last` of the tail block, growing it would 
+ * have `ngx_pool_release()` hand its tail out again, so that's declined.
+ * 
+ * Returns NGX_OK if the allocation now spans `new_size` bytes, NGX_DECLINED 
+ * otherwise, in which case nothing has changed.
+ */
+ngx_int_t ngx_pextend(ngx_pool_t *pool, void *p, size_t old_size, size_t new_size) {
+    u_char      *end;
+    ngx_pool_t  *b;
+
+    end = (u_char *) p + old_size;
+
+    for (b = pool->current; b; b = b->d.next) {
+
+        if (end != b->d.last) {
+            continue;
+        }
+
+        if (new_size > old_size && (size_t) (b->d.end - end) < new_size - old_size) {
+            return NGX_DECLINED;
+        }
+
+        if (pool->mark && b == pool->mark->block && (u_char *) p < pool->mark->last) {
+            return NGX_DECLINED;
+        }
+
+        ngx_pool_dirty(b); /* a shrunk allocation leaves written bytes past the new `d.last` */
+
+        b->d.last = (u_char *) p + new_size;
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+/**
+ * ngx_prealloc resizes an allocation made from the pool to `new_size` bytes. 
+ * It's grown in place with `ngx_pextend()` if it's the last one of its block 
+ * and the block has room, otherwise it's moved into a new allocation. 
+ * 
+ * A large allocation left behind by the copy is given back with `ngx_pfree()`, 
+ * a small one stays in the pool until the pool goes away. Which one it was 
+ * follows from `old_size`, the same way `ngx_palloc()` decides. 
+ * 
+ * Returns the (possibly moved) allocation, or NULL if a new one couldn't be 
+ * made, in which case the old one is left untouched.
+ */
+void *ngx_prealloc(ngx_pool_t *pool, void *p, size_t old_size, size_t new_size) {
+    void  *new;
+
+    if (p == NULL) {
+        return ngx_palloc(pool, new_size);
+    }
+
+    if (new_size <= old_size) {
+        return p;
+    }
+
+    if (ngx_pextend(pool, p, old_size, new_size) == NGX_OK) {
+        return p;
+    }
+
+    new = ngx_palloc(pool, new_size);
+    if (new == NULL) {
         return NULL;
     }
 
-    large->alloc = p;
-    large->next = pool->large;
-    pool->large = large;
+    ngx_memcpy(new, p, old_size);
 
-    return p;
+#if !(NGX_DEBUG_PALLOC)
+    if (old_size > pool->max)
+#endif
+    {
+        (void) ngx_pfree(pool, p);
+    }
+
+    return new;
 }
 
 
-/* only for large allocations */
+/**
+ * Only for large allocations, small ones (and pointers of other pools) are 
+ * declined, in O(1). 
+ * 
+ * The word right in front of `p` is read first: for a large allocation of any 
+ * pool it's the tag of its linked node (see `ngx_pool_large_t`), in front of 
+ * a small allocation it's a block header or an earlier small allocation, which 
+ * matches the tag only by accident. Nothing else in front of `p` is read until 
+ * the tag matches, and the node is then still checked to point back at `p`, 
+ * belong to this pool and be linked where it says it is.
+ */
 ngx_int_t ngx_pfree(ngx_pool_t *pool, void *p) {
     ngx_pool_large_t  *l;
 
-    for (l = pool->large; l; l = l->next) {
-        if (p == l->alloc) {
-            ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "free: %p", l->alloc);
-            ngx_free(l->alloc);
-            l->alloc = NULL;
+#if (NGX_THREADS)
+    if (pool->serial) {
+        pool = ngx_pool_thread_get(pool);
+        if (pool == NULL) {
+            return NGX_DECLINED;
+        }
+    }
+#endif
+
+    if (ngx_pool_large_magic(p) != (NGX_POOL_LARGE_MAGIC ^ (uintptr_t) p)) {
+        return NGX_DECLINED;
+    }
+
+    l = ngx_pool_large_node(p);
+
+    if (l->alloc != p || l->pool != pool || l->prev == NULL || *l->prev != l) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "free: %p", l->alloc);
+
+    ngx_pool_large_free(pool, l);
+
+    return NGX_OK;
+}
+
+
+/* size class of a large chunk within `pool->cached`, NGX_POOL_LARGE_CLASSES if it's too big to be kept */
+static ngx_uint_t ngx_pool_large_class(size_t size) {
+    ngx_uint_t  c;
+
+    for (c = 0, size >>= NGX_POOL_LARGE_SHIFT; size && c < NGX_POOL_LARGE_CLASSES; size >>= 1, c++) {
+        /* void */
+    }
+
+    return c;
+}
+
+
+/* insert at the head of the list of large allocations */
+static void ngx_pool_large_link(ngx_pool_t *pool, ngx_pool_large_t *l) {
+    l->magic = NGX_POOL_LARGE_MAGIC ^ (uintptr_t) l->alloc;
+    l->pool = pool;
+    l->next = pool->large;
+    l->prev = &pool->large;
+
+    if (l->next) {
+        l->next->prev = &l->next;
+    }
+
+    pool->large = l;
+}
+
+
+/**
+ * Unlink in O(1). Checkpoints taken by `ngx_pool_mark()` remember the 
+ * head of the list, if that's the node going away, they're moved on to 
+ * the next older node, which is exactly what the head would have been 
+ * had this node never been allocated.
+ */
+static void ngx_pool_large_unlink(ngx_pool_t *pool, ngx_pool_large_t *l) {
+    ngx_pool_mark_t  *mark;
 
-            return NGX_OK;
+    for (mark = pool->mark; mark; mark = mark->prev) {
+        if (mark->large == l) {
+            mark->large = l->next;
         }
     }
 
-    return NGX_DECLINED;
+    *l->prev = l->next;
+
+    if (l->next) {
+        l->next->prev = l->prev;
+    }
+
+    l->next = NULL;
+    l->prev = NULL;
+    l->magic = 0;
 }
 
 
+/**
+ * Unlink the chunk and keep it in its class slot for reuse if the slot 
+ * is free (or holds a smaller chunk), otherwise free() it.
+ */
+static void ngx_pool_large_free(ngx_pool_t *pool, ngx_pool_large_t *l) {
+    ngx_uint_t         c;
+    ngx_pool_large_t  *old;
+
+    ngx_pool_large_unlink(pool, l);
+
+    c = ngx_pool_large_class(l->size);
+
+    if (c == NGX_POOL_LARGE_CLASSES || (u_char *) l->alloc - (u_char *) l->start != NGX_POOL_LARGE_HSIZE) {
+        ngx_free(l->start);
+        return;
+    }
+
+    old = pool->cached[c];
+
+    if (old && old->size >= l->size) {
+        ngx_free(l->start);
+        return;
+    }
+
+    if (old) {
+        ngx_free(old->start);
+    }
+
+    pool->cached[c] = l;
+}
+
+
+/* free() every chunk kept for reuse */
+static void ngx_pool_large_flush(ngx_pool_t *pool) {
+    ngx_uint_t  c;
+
+    for (c = 0; c < NGX_POOL_LARGE_CLASSES; c++) {
+        if (pool->cached[c]) {
+            ngx_free(pool->cached[c]->start);
+            pool->cached[c] = NULL;
+        }
+    }
+}
+
+
+/**
+ * ngx_pcalloc returns zeroed memory. Small allocations are only memset below 
+ * the known-zero watermark of the block they come from, so carving a big 
+ * connection or request structure out of a fresh (or bulk zeroed) block costs 
+ * no memset at all.
+ */
 void *ngx_pcalloc(ngx_pool_t *pool, size_t size) {
     void *p;
 
-    p = ngx_palloc(pool, size);
+#if (NGX_THREADS)
+    if (pool->serial) {
+        pool = ngx_pool_thread_get(pool);
+        if (pool == NULL) {
+            return NULL;
+        }
+    }
+#endif
+
+#if !(NGX_DEBUG_PALLOC)
+    if (size <= pool->max) {
+        return ngx_palloc_small(pool, size, 1, 1);
+    }
+#endif
+
+    p = ngx_palloc_large(pool, size);
     if (p) {
         ngx_memzero(p, size);
     }
@@ -438,50 +1715,124 @@ void *ngx_pcalloc(ngx_pool_t *pool, size_t size) {
 }
 
 /**
- * ngx_pool_cleanup_add allocates a new `ngx_pool_cleanup_t` struct from the
- * same pool that's passed into it, possibly allocates additional storage from 
- * the pool too, the size of which is determined by the `size` parameter, and inserts
- * the newly allocated `ngx_pool_cleanup_t` struct at the head of the singly-linked 
- * list of "cleanups". The caller may set the required cleanup handler and store
- * data that should be passed into the handler within the additionally allocted storage 
- * after this function returnes. Cleanup handlers are called in order of singly-linked
- * list iteration just before the pool gets destoryed.
+ * ngx_pool_cleanup_add registers a cleanup handler, which is run when the pool 
+ * gets destroyed (or a checkpoint taken before the registration is released). 
+ * The caller sets `handler` after this function returns and may store the data 
+ * the handler needs in the `size` bytes at `data`.
+ * 
+ * The node is taken from the slots embedded into the "main" pool while there 
+ * are any left, so most pools (a connection or a request closing a file or two) 
+ * never allocate for it; `data`, if any, is then a single `ngx_palloc()`. Once 
+ * the slots run out, the node and its data are allocated in one go, the data 
+ * right after the node. Either way it's one allocation at most instead of two.
+ * 
+ * The nodes make up a doubly-linked list (through `prev`, like large allocations 
+ * do), newest first, so that `ngx_pool_cleanup_remove()` is O(1).
  */
 ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *p, size_t size) {
+    ngx_uint_t           i;
     ngx_pool_cleanup_t  *c;
 
-    c = ngx_palloc(p, sizeof(ngx_pool_cleanup_t)); /* allocates via `ngx_palloc_small()` */
-    if (c == NULL) {
-        return NULL;
-    }
+    if (p->free_slots) {
 
-    if (size) {
+        for (i = 0; !(p->free_slots & ((ngx_uint_t) 1 << i)); i++) { /* void */ }
 
-        /**  
-         * May allocate via `ngx_palloc_small()` or `ngx_palloc_large()`,
-         * depending whether `size` is greater than "main" pool's `max` 
-         * field.   
-         * 
-         * Will be passed to `ngx_pool_cleanup_t` `handler` as the only argument, 
-         * before this pool gets destroyed. The `handler` is set by the caller
-         * after this function returns this `ngx_pool_cleanup_t` instance. The
-         * caller may also store necessary data in the storage allocated here.
-         */
+        c = &p->slots[i];
 
-        c->data = ngx_palloc(p, size); 
-        if (c->data == NULL) {
-            return NULL;
+        if (size) {
+            /**  
+             * May allocate via `ngx_palloc_small()` or `ngx_palloc_large()`,
+             * depending whether `size` is greater than "main" pool's `max` 
+             * field.   
+             */
+            c->data = ngx_palloc(p, size); 
+            if (c->data == NULL) {
+                return NULL;
+            }
+        } else {
+            c->data = NULL;
         }
+
+        p->free_slots &= ~((ngx_uint_t) 1 << i); /* taken only once nothing can fail */
+
+        c->embedded = 1;
+        c->large = 0;
+
     } else {
-        c->data = NULL;
+        c = ngx_palloc(p, NGX_POOL_CLEANUP_HSIZE + size);
+        if (c == NULL) {
+            return NULL;
+        }
+
+        c->data = size ? (u_char *) c + NGX_POOL_CLEANUP_HSIZE : NULL;
+        c->embedded = 0;
+        c->large = (NGX_POOL_CLEANUP_HSIZE + size > p->max);
     }
 
-    c->handler = NULL;    /*set by the caller after this function returns */
+    c->handler = NULL;    /* set by the caller after this function returns */
     c->next = p->cleanup; /* insert at the head */
+    c->prev = &p->cleanup;
+
+    if (c->next) {
+        c->next->prev = &c->next;
+    }
 
     p->cleanup = c;       /* insert at the head */
 
     ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, p->log, 0, "add cleanup: %p", c);
 
     return c;
-}
\ No newline at end of file
+}
+
+
+/**
+ * ngx_pool_cleanup_remove cancels a cleanup registered by `ngx_pool_cleanup_add()` 
+ * without running its handler, e.g. a file was closed early. The node is unlinked 
+ * in O(1); an embedded slot becomes free again, a node allocated along with large 
+ * data is given back through `ngx_pfree()`, small ones stay in the pool until it's 
+ * reset or destroyed as usual.
+ */
+void ngx_pool_cleanup_remove(ngx_pool_t *p, ngx_pool_cleanup_t *c) {
+    if (c->prev == NULL) {
+        return; /* already removed */
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, p->log, 0, "remove cleanup: %p", c);
+
+    ngx_pool_cleanup_unlink(p, c);
+
+    c->handler = NULL;
+
+    if (c->embedded) {
+        p->free_slots |= (ngx_uint_t) 1 << (c - p->slots);
+        return;
+    }
+
+    if (c->large) {
+        (void) ngx_pfree(p, c);
+    }
+}
+
+
+/**
+ * Checkpoints remember the head of the list, a node going away moves them 
+ * on to the next older one (see `ngx_pool_large_unlink()`).
+ */
+static void ngx_pool_cleanup_unlink(ngx_pool_t *pool, ngx_pool_cleanup_t *c) {
+    ngx_pool_mark_t  *mark;
+
+    for (mark = pool->mark; mark; mark = mark->prev) {
+        if (mark->cleanup == c) {
+            mark->cleanup = c->next;
+        }
+    }
+
+    *c->prev = c->next;
+
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+
+    c->next = NULL;
+    c->prev = NULL;
+}
@@ -20,6 +20,56 @@
 #define NGX_POOL_ALIGNMENT       16
 
 
+/*
+ * Pool blocks of exactly `ngx_pool_cache.size` bytes (NGX_DEFAULT_POOL_SIZE
+ * unless changed by `ngx_pool_cache_init()`) are recycled through a per-worker
+ * cache instead of going back to free(3). When the cache reaches its high
+ * watermark it is trimmed down to the low one. With `ngx_pool_cache.zero`
+ * set, blocks are zeroed as they're cached, so `ngx_pcalloc()` from a block
+ * handed out again needs no memset.
+ */
+#define NGX_POOL_CACHE_LOW       64
+#define NGX_POOL_CACHE_HIGH      256
+
+
+/*
+ * In arena mode blocks of the cached size are carved out of per-worker
+ * 2MB arenas backed by huge pages (see `ngx_alloc_huge()`), the first block
+ * of every arena holds its `ngx_pool_arena_t` header.
+ */
+#define NGX_POOL_ARENA_SIZE      (2 * 1024 * 1024)
+
+
+/*
+ * Pools created with `ngx_create_pool_tagged()` carry a call-site id. On
+ * destruction the pool's usage is recorded into a per-site histogram with
+ * buckets of 1KB, 2KB, ... 512KB, which periodically yields the initial size
+ * for the next pools created at that site. Site 0 is never sampled.
+ */
+#define NGX_POOL_SITE_NONE       0
+#define NGX_POOL_SITES           16
+#define NGX_POOL_SITE_BUCKETS    10
+#define NGX_POOL_SITE_MIN_SIZE   1024
+#define NGX_POOL_SITE_SAMPLES    256
+#define NGX_POOL_SITE_PERCENTILE 95
+
+
+/*
+ * Large allocations freed by `ngx_pfree()` are kept for reuse by the same
+ * pool, one per size class: below 8KB, 16KB, ... 256KB. Bigger ones are
+ * always free()d.
+ */
+#define NGX_POOL_LARGE_CLASSES   6
+#define NGX_POOL_LARGE_SHIFT     13
+
+
+/*
+ * Every pool embeds a few cleanup nodes, so registering a cleanup handler
+ * (e.g. closing a file) normally takes no allocation at all.
+ */
+#define NGX_POOL_CLEANUP_SLOTS   4
+
+
 typedef void (*ngx_pool_cleanup_pt)(void *data);       /* TODO!!!!! */
 
 typedef struct ngx_pool_cleanup_s  ngx_pool_cleanup_t; /* TODO!!!!! */
@@ -28,36 +78,174 @@ struct ngx_pool_cleanup_s {
     ngx_pool_cleanup_pt   handler; /* TODO!!!!! */
     void                 *data;    /* TODO!!!!! */
     ngx_pool_cleanup_t   *next;    /* TODO!!!!! */
+    ngx_pool_cleanup_t  **prev;    /* pointer which points at this node, either `pool->cleanup` or the previous node's `next` */
+    unsigned              embedded:1; /* one of `pool->slots` */
+    unsigned              large:1;    /* node and data share a large allocation, given back by `ngx_pool_cleanup_remove()` */
 };
 
 
 typedef struct ngx_pool_large_s  ngx_pool_large_t;    /* TODO!!!!! */
 
+/*
+ * Every large allocation carries its `ngx_pool_large_t` node in-band, right
+ * in front of the memory handed out to the caller, so `ngx_pfree()` finds
+ * and unlinks it without walking the list of large allocations.
+ *
+ * The node's last word, the one right in front of `alloc`, is a tag telling
+ * a linked node apart. It's the only word `ngx_pfree()` reads before it knows
+ * the pointer is a large allocation: in front of a small one there's always
+ * at least a block header, so that word is the pool's own memory either way.
+ */
 struct ngx_pool_large_s {
-    ngx_pool_large_t     *next;    /* TODO!!!!! */
-    void                 *alloc;   /* TODO!!!!! */
+    ngx_pool_large_t     *next;    /* next (older) live large allocation */
+    ngx_pool_large_t    **prev;    /* pointer which points at this node, either `pool->large` or the previous node's `next` */
+    void                 *alloc;   /* memory handed out to the caller, the node is right in front of it */
+    void                 *start;   /* memory returned by malloc(3), the node and alignment padding included */
+    size_t                size;    /* usable bytes at `alloc` */
+    ngx_pool_t           *pool;    /* owner pool, validates pointers passed to `ngx_pfree()` */
+    uintptr_t             magic;   /* NGX_POOL_LARGE_MAGIC ^ `alloc` while linked, 0 otherwise, must be last */
+};
+
+
+#define NGX_POOL_LARGE_MAGIC     ((uintptr_t) 0x6c726765)  /* "lrge" */
+
+#define ngx_pool_large_node(p)   ((ngx_pool_large_t *) (p) - 1)
+
+/* the tag word right in front of `p`, see `ngx_pfree()` */
+#define ngx_pool_large_magic(p)  (((uintptr_t *) (p))[-1])
+
+
+typedef struct ngx_pool_mark_s  ngx_pool_mark_t;
+
+
+#if (NGX_THREADS)
+
+typedef struct ngx_pool_thread_s  ngx_pool_thread_t;
+
+/*
+ * A thread allocating from a thread-safe pool gets a sub-pool of its own,
+ * the entry lives in that sub-pool and is pushed onto the owner's list.
+ */
+struct ngx_pool_thread_s {
+    ngx_pool_thread_t    *next;
+    ngx_tid_t             tid;     /* thread the sub-pool belongs to */
+    ngx_pool_t           *pool;    /* the sub-pool */
 };
 
+#endif
+
 
 typedef struct {
     u_char               *last;    /* TODO!!!!! */
     u_char               *end;     /* TODO!!!!! */
     ngx_pool_t           *next;    /* TODO!!!!! */
     ngx_uint_t            failed;  /* TODO!!!!! */
+    u_char               *zero;    /* known-zero watermark, everything from the greater of it and `last` up to `end` reads as zeroes */
+    unsigned              arena:1; /* the block was carved out of a huge-page arena */
 } ngx_pool_data_t;
 
 
+/*
+ * Memory below `d.last` has been handed out and may have been written to,
+ * so before `d.last` is ever moved back the known-zero watermark has to be
+ * raised past it.
+ */
+#define ngx_pool_dirty(b)                                                     \
+    do {                                                                      \
+        if ((b)->d.zero < (b)->d.last) {                                      \
+            (b)->d.zero = (b)->d.last;                                        \
+        }                                                                     \
+    } while (0)
+
+
 struct ngx_pool_s {
     ngx_pool_data_t       d;       /* TODO!!!!! */
     size_t                max;     /* TODO!!!!! */
     ngx_pool_t           *current; /* TODO!!!!! */
     ngx_chain_t          *chain;   /* TODO!!!!! */
     ngx_pool_large_t     *large;   /* TODO!!!!! */
+    ngx_pool_large_t     *cached[NGX_POOL_LARGE_CLASSES]; /* freed large allocations kept for reuse, one per size class */
     ngx_pool_cleanup_t   *cleanup; /* TODO!!!!! */
+    ngx_pool_cleanup_t    slots[NGX_POOL_CLEANUP_SLOTS]; /* embedded cleanup nodes */
+    ngx_uint_t            free_slots; /* bitmask of unused `slots` */
     ngx_log_t            *log;     /* TODO!!!!! */
+    ngx_uint_t            site;    /* call-site id for adaptive sizing, NGX_POOL_SITE_NONE if untagged */
+    ngx_pool_mark_t      *mark;    /* innermost checkpoint set by `ngx_pool_mark()`, if any */
+    ngx_uint_t            keep;    /* blocks kept by a trimming reset */
+    ngx_uint_t            trim;    /* chain length which turns `ngx_reset_pool()` into a trimming one, 0 never */
+#if (NGX_THREADS)
+    ngx_pool_thread_t * volatile  threads; /* sub-pools of the threads which allocated from a thread-safe pool */
+    ngx_uint_t            serial;  /* non-zero for thread-safe pools, a new one every time its sub-pools go away */
+    ngx_tid_t             owner;   /* thread which created the thread-safe pool (or the sub-pool), allocates from it directly */
+    ngx_pool_t           *parent;  /* thread-safe pool a sub-pool belongs to, NULL otherwise */
+#endif
 };
 
 
+/*
+ * A checkpoint of the pool state, everything allocated or registered after
+ * `ngx_pool_mark()` is given back by `ngx_pool_release()`. Checkpoints nest
+ * and must be released in LIFO order; releasing an outer one drops the inner.
+ */
+struct ngx_pool_mark_s {
+    ngx_pool_t           *current; /* `pool->current` at the time of the mark */
+    ngx_pool_t           *block;   /* tail block of the chain at the time of the mark */
+    u_char               *last;    /* its `d.last` */
+    ngx_pool_large_t     *large;   /* head of the large allocations list */
+    ngx_pool_cleanup_t   *cleanup; /* head of the cleanups list */
+    ngx_chain_t          *chain;   /* head of the free chain links list */
+    ngx_pool_mark_t      *prev;    /* enclosing checkpoint */
+};
+
+
+typedef struct ngx_pool_cache_block_s  ngx_pool_cache_block_t;
+
+struct ngx_pool_cache_block_s {
+    ngx_pool_cache_block_t  *next;   /* overlays the first word of a cached (unused) pool block */
+};
+
+
+typedef struct {
+    ngx_queue_t              queue;  /* in `ngx_pool_cache.arenas` while it has blocks to hand out, must be first */
+    ngx_pool_cache_block_t  *free;   /* blocks given back to the arena */
+    u_char                  *last;   /* next never handed out block */
+    u_char                  *end;
+    size_t                   size;   /* block size the arena is carved into */
+    ngx_uint_t               used;   /* blocks currently handed out */
+    unsigned                 huge:1; /* backed by the hugetlbfs pool rather than THP */
+    unsigned                 queued:1;
+} ngx_pool_arena_t;
+
+
+typedef struct {
+    ngx_pool_cache_block_t  *free;   /* stack of cached blocks, the most recently freed (cache hot) block on top */
+    ngx_uint_t               nfree;  /* number of blocks currently in the stack */
+    size_t                   size;   /* only blocks of exactly this size are cached */
+    ngx_uint_t               low;    /* number of blocks left in the stack after trimming */
+    ngx_uint_t               high;   /* stack size which triggers trimming, 0 disables the cache */
+
+    ngx_uint_t               hits;   /* blocks served from the stack */
+    ngx_uint_t               misses; /* blocks of the cached size which had to be ngx_memalign()ed */
+    ngx_uint_t               puts;   /* blocks pushed back onto the stack */
+    ngx_uint_t               trims;  /* blocks handed back to free(3) while trimming */
+    ngx_uint_t               zeroed; /* bytes zeroed in bulk */
+
+    unsigned                 arena:1; /* carve blocks of the cached size out of huge-page arenas */
+    unsigned                 zero:1; /* zero blocks in bulk as they're pushed onto the stack */
+    ngx_queue_t              arenas; /* arenas with blocks left to hand out */
+    ngx_uint_t               narenas; /* arenas currently mapped */
+    ngx_uint_t               nhuge;  /* of them backed by the hugetlbfs pool */
+} ngx_pool_cache_t;
+
+
+typedef struct {
+    ngx_uint_t               pools;  /* pools sampled since the size was last picked */
+    ngx_uint_t               chained; /* of those, pools which needed more than one block */
+    ngx_uint_t               hist[NGX_POOL_SITE_BUCKETS]; /* usage at destruction, bucket `i` is up to (1KB << i) */
+    size_t                   size;   /* picked initial size, 0 until enough pools were sampled */
+} ngx_pool_site_t;
+
+
 typedef struct {
     ngx_fd_t              fd;      /* TODO!!!!! */
     u_char               *name;    /* TODO!!!!! */
@@ -65,4 +253,37 @@ typedef struct {
 } ngx_pool_cleanup_file_t;
 
 
+ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log);
+ngx_pool_t *ngx_create_pool_tagged(size_t size, ngx_uint_t site, ngx_log_t *log);
+#if (NGX_THREADS)
+ngx_pool_t *ngx_create_pool_mt(size_t size, ngx_log_t *log);
+#endif
+void ngx_destroy_pool(ngx_pool_t *pool);
+void ngx_reset_pool(ngx_pool_t *pool);
+void ngx_reset_pool_trim(ngx_pool_t *pool, ngx_uint_t keep);
+void ngx_pool_set_trim(ngx_pool_t *pool, ngx_uint_t keep, ngx_uint_t trim);
+
+void *ngx_palloc(ngx_pool_t *pool, size_t size);
+void *ngx_pnalloc(ngx_pool_t *pool, size_t size);
+void *ngx_pcalloc(ngx_pool_t *pool, size_t size);
+void *ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment);
+void *ngx_prealloc(ngx_pool_t *pool, void *p, size_t old_size, size_t new_size);
+ngx_int_t ngx_pextend(ngx_pool_t *pool, void *p, size_t old_size, size_t new_size);
+ngx_int_t ngx_pfree(ngx_pool_t *pool, void *p);
+
+ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *p, size_t size);
+void ngx_pool_cleanup_remove(ngx_pool_t *p, ngx_pool_cleanup_t *c);
+
+void ngx_pool_mark(ngx_pool_t *pool, ngx_pool_mark_t *mark);
+void ngx_pool_release(ngx_pool_t *pool, ngx_pool_mark_t *mark);
+
+void ngx_pool_cache_init(size_t size, ngx_uint_t low, ngx_uint_t high);
+ngx_int_t ngx_pool_arena_init(ngx_log_t *log);
+u_char *ngx_pool_stats_json(ngx_pool_t *pool, u_char *buf, u_char *last);
+
+
+extern ngx_pool_cache_t  ngx_pool_cache;
+extern ngx_pool_site_t   ngx_pool_sites[NGX_POOL_SITES];
+
+
 #endif /* _NGX_PALLOC_H_INCLUDED_ */
\ No newline at end of file
@@ -5,6 +5,28 @@
 #if (NGX_HAVE_ATOMIC_OPS)
 
 
+static void ngx_shmtx_wakeup(ngx_shmtx_t *mtx);
+
+#if (NGX_HAVE_FUTEX)
+
+static void ngx_shmtx_futex_lock(ngx_shmtx_t *mtx);
+
+/**
+ * `FUTEX_WAIT`/`FUTEX_WAKE` operate on a 32-bit word, while `ngx_atomic_t`
+ * is a machine word. The lock word never holds more than 32 significant bits
+ * (pid plus the waiters flag), so the futex is the half of the word holding
+ * the low bits: the first one on little-endian, the last one on big-endian.
+ */
+#if (NGX_HAVE_LITTLE_ENDIAN)
+#define ngx_shmtx_futex(mtx)  ((uint32_t *) (mtx)->lock)
+#else
+#define ngx_shmtx_futex(mtx)                                                  \
+    ((uint32_t *) (mtx)->lock + (sizeof(ngx_atomic_t) / sizeof(uint32_t) - 1))
+#endif
+
+#endif
+
+
 ngx_int_t ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name) {
     mtx->lock = &addr->lock; /* TODO!!!!! */
 
@@ -12,7 +34,13 @@ ngx_int_t ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
         return NGX_OK; 
     }
 
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_FUTEX)
+
+    mtx->wait = &addr->wait; /* the lock word is the futex, nothing else to set up */
+
+#endif
+
+#if (NGX_HAVE_POSIX_SEM && !NGX_HAVE_FUTEX)
 
     mtx->wait = &addr->wait; /* TODO!!!!! */
 
@@ -57,7 +85,7 @@ ngx_int_t ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
 
 
 void ngx_shmtx_destroy(ngx_shmtx_t *mtx) {
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_POSIX_SEM && !NGX_HAVE_FUTEX)
 
     if (mtx->semaphore) {
 
@@ -142,6 +170,18 @@ void ngx_shmtx_lock(ngx_shmtx_t *mtx) {
             }
         }
 
+#if (NGX_HAVE_FUTEX)
+
+        /**
+         * Spinning didn't help, sleep on the futex word until the owner
+         * hands the lock over in `ngx_shmtx_unlock`.
+         */
+        ngx_shmtx_futex_lock(mtx);
+
+        return;
+
+#else
+
 #if (NGX_HAVE_POSIX_SEM)
 
         /**
@@ -182,6 +222,8 @@ void ngx_shmtx_lock(ngx_shmtx_t *mtx) {
 #endif
 
         ngx_sched_yield();
+
+#endif
     } 
 }
 
@@ -191,6 +233,24 @@ void ngx_shmtx_unlock(ngx_shmtx_t *mtx) {
         ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0, "shmtx unlock");
     }
 
+#if (NGX_HAVE_FUTEX)
+
+    if (ngx_atomic_cmp_set(mtx->lock, ngx_pid, 0)) {
+        /* uncontended, nobody sleeps on the futex, no syscall */
+        return;
+    }
+
+    /**
+     * Waiters flag is set, release the lock and wake one of them
+     * up. The flag can't be cleared behind the owner's back, 
+     * only set, hence a single attempt is enough.
+     */
+    if (ngx_atomic_cmp_set(mtx->lock, ngx_pid | NGX_SHMTX_WAITERS, 0)) {
+        ngx_shmtx_wakeup(mtx);
+    }
+
+#else
+
     /**
      * Unlock the lock before waking up one of the processes possibly blocked 
      * on the posix sempahore (if any) 
@@ -211,6 +271,8 @@ void ngx_shmtx_unlock(ngx_shmtx_t *mtx) {
 
         ngx_shmtx_wakeup(mtx);
     }
+
+#endif
 }
 
 /* TODO!!!!! in what scenarios is this used? */
@@ -223,12 +285,37 @@ ngx_uint_t ngx_shmtx_force_unlock(ngx_shmtx_t *mtx, ngx_pid_t pid) {
         return 1;
     }
 
+#if (NGX_HAVE_FUTEX)
+    if (ngx_atomic_cmp_set(mtx->lock, pid | NGX_SHMTX_WAITERS, 0)) {
+        /* the dead owner had processes sleeping on the futex */
+        ngx_shmtx_wakeup(mtx);
+        return 1;
+    }
+#endif
+
     return 0;
 }
 
 
 static void ngx_shmtx_wakeup(ngx_shmtx_t *mtx) {
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_FUTEX)
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0, "shmtx wake");
+
+    /**
+     * Wake up at most one process sleeping on the futex word. The 
+     * woken process reacquires the lock with the waiters flag set 
+     * only if other processes are still counted in `wait`, so the 
+     * rest of the queue is woken one by one on subsequent unlocks.
+     * 
+     * Not a private futex (`FUTEX_WAKE_PRIVATE`): the word lives in 
+     * shared memory and the waiters are other processes.
+     */
+    if (syscall(SYS_futex, ngx_shmtx_futex(mtx), FUTEX_WAKE, 1, NULL, NULL, 0) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno, "futex(FUTEX_WAKE) failed while wake shmtx");
+    }
+
+#elif (NGX_HAVE_POSIX_SEM)
     ngx_atomic_uint_t   wait;
 
     if (!mtx->semaphore) {
@@ -291,4 +378,74 @@ static void ngx_shmtx_wakeup(ngx_shmtx_t *mtx) {
 }
 
 
+#if (NGX_HAVE_FUTEX)
+
+/**
+ * Contended path of `ngx_shmtx_lock`, entered after spinning failed.
+ * 
+ * Counts the process in `wait`, sets the waiters flag on the lock 
+ * word and sleeps on the futex until the word changes. The lock is 
+ * acquired in the contended state (`ngx_pid | NGX_SHMTX_WAITERS`) 
+ * only if some other process is counted too, it may be asleep and 
+ * its wakeup must not be lost. A process counted after that check 
+ * finds the flag clear and sets it itself before going to sleep, so 
+ * a lock handed over to the last sleeper is unlocked with no syscall.
+ */
+static void ngx_shmtx_futex_lock(ngx_shmtx_t *mtx) {
+    ngx_err_t           err;
+    ngx_atomic_uint_t   lock, waiters;
+
+    (void) ngx_atomic_fetch_add(mtx->wait, 1);
+
+    for ( ;; ) {
+
+        lock = *mtx->lock;
+
+        if (lock == 0) {
+
+            waiters = (*mtx->wait > 1) ? NGX_SHMTX_WAITERS : 0;
+
+            if (ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid | waiters)) {
+                break;
+            }
+
+            continue;
+        }
+
+        if (!(lock & NGX_SHMTX_WAITERS)) {
+
+            if (!ngx_atomic_cmp_set(mtx->lock, lock, lock | NGX_SHMTX_WAITERS)) {
+                /* released or flagged by someone else meanwhile, reload */
+                continue;
+            }
+
+            lock |= NGX_SHMTX_WAITERS;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0, "shmtx wait %uA", lock);
+
+        /**
+         * Sleeps only if the futex word still equals `lock`, checked 
+         * atomically by the kernel against a concurrent `FUTEX_WAKE`,
+         * otherwise fails immediately with EAGAIN.
+         */
+        if (syscall(SYS_futex, ngx_shmtx_futex(mtx), FUTEX_WAIT, (uint32_t) lock, NULL, NULL, 0) == -1) {
+
+            err = ngx_errno;
+
+            if (err != NGX_EAGAIN && err != NGX_EINTR) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err, "futex(FUTEX_WAIT) failed while waiting on shmtx");
+                ngx_sched_yield();
+            }
+        }
+
+        ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0, "shmtx awoke");
+    }
+
+    (void) ngx_atomic_fetch_add(mtx->wait, -1);
+}
+
+#endif
+
+
 #endif
\ No newline at end of file
@@ -63,9 +63,44 @@
  * are less widely available (especially on older systems) than System V semaphores.
  */
 
+/**
+ * Linux futex
+ * ===============
+ * A futex ("fast userspace mutex") is a 32-bit word in (possibly shared) memory
+ * paired with a kernel wait queue, which the kernel keys by the physical page and
+ * offset of the word. `FUTEX_WAIT` puts the caller to sleep only if the word still
+ * holds the expected value (otherwise fails with EAGAIN right away), `FUTEX_WAKE`
+ * wakes up to N sleepers queued on the word.
+ *
+ * With a futex the lock word itself says whether anyone sleeps on it, so the
+ * shared mutex doesn't need the posix semaphore (`sem_post` is a syscall on
+ * every contended unlock, whether or not someone is still blocked on it).
+ * The lock word has three states:
+ *
+ *     0                           - free;
+ *     ngx_pid                     - locked, nobody sleeps on the futex;
+ *     ngx_pid | NGX_SHMTX_WAITERS - locked, there may be sleepers (contended).
+ *
+ * The owner's pid stays in the word, so `ngx_shmtx_force_unlock` keeps working
+ * for crashed workers. Linux pids never exceed 2^22 (`PID_MAX_LIMIT`), which
+ * leaves the top bit of the 32-bit futex word free for the waiters flag.
+ *
+ * Unlocking a lock nobody waits on is a single CAS with no syscall, `FUTEX_WAKE`
+ * is issued only when the waiters flag is set.
+ *
+ * The `wait` counter still counts the processes in the sleeping loop, so that
+ * a woken process sets the waiters flag again only if somebody else may sleep
+ * on the futex. Otherwise every handoff to a woken process would cost its own
+ * unlock a `FUTEX_WAKE` with nobody left to wake.
+ */
+#if (NGX_HAVE_FUTEX)
+#define NGX_SHMTX_WAITERS  0x80000000
+#endif
+
+
 /**
  * Container for `ngx_shmtx_t`s (process shared mutex) `lock` word 
- * and posix semaphore current waiters count `wait` word.
+ * and posix semaphore (or futex) current waiters count `wait` word.
  * 
  * In case of 'ngx_shm_t' (process shared memory area) occupies
  * the first 2 words of the mmaped chunk to which 'ngx_shm_t'
@@ -76,7 +111,7 @@
  */
 typedef struct {
     ngx_atomic_t    lock;       /* volatile unsigned long */
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_POSIX_SEM || NGX_HAVE_FUTEX)
     ngx_atomic_t    wait;       /* volatile unsigned long */
 #endif
 } ngx_shmtx_sh_t;
@@ -97,14 +132,15 @@ typedef struct {
      * points to 1st word of the `ngx_slab_pool_t` struct.
      */
     ngx_atomic_t    *lock;      /* pointer to volatile unsigned long */
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_POSIX_SEM || NGX_HAVE_FUTEX)
     /**
-     * Machine word used for posix semaphore current waiters 
-     * count `wait` word.
+     * Machine word used for posix semaphore (or futex) 
+     * current waiters count `wait` word.
      * 
      * Used by mutex unlock routine to determine if it
      * needs to do a `sem_post` to release one of the 
-     * waiters.
+     * waiters, and by a process woken from the futex to
+     * determine if it must keep the waiters flag set.
      * 
      * If this shared mutex is used with 'ngx_shm_t' 
      * (process shared memory area), points to the
@@ -115,7 +151,8 @@ typedef struct {
      * points to 2nd word of the `ngx_slab_pool_t` struct.
      */
     ngx_atomic_t    *wait;      /* pointer to volatile unsigned long */
-
+#endif
+#if (NGX_HAVE_POSIX_SEM && !NGX_HAVE_FUTEX)
     /**
      * If set to 1, signals that the posix semaphore
      * was initialized and is ready for use.
@@ -135,7 +172,7 @@ typedef struct {
      * Log base 2 of this value is used to calculate 
      * the amount of spin-lock passes on attempts to 
      * acquire this shared mutex, before blocking on 
-     * the posix sempahore.
+     * the posix sempahore (or the futex word).
      * 
      * Each spin-lock pass starts from 1 call to the
      * assembly "PAUSE" instruction, the number of "PAUSE" 
@@ -1,26 +1,101 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 
+#if (NGX_HAVE_AVX2 && NGX_PTR_SIZE == 8)
+#include <immintrin.h>
+#endif
+
 
-#define NGX_SLAB_PAGE       0
-#define NGX_SLAB_BIG        1
+/**
+ * Type of a page, kept in the lowest 2 bits of its header's `prev` 
+ * (page headers are word aligned, so those bits of a pointer are free):
+ *   - NGX_SLAB_PAGE: free pages and pages handed out as a whole;
+ *   - NGX_SLAB_BIG: chunks bigger than the exact size, the bitmap fits 
+ *     into the upper half of `slab`, the lower one holds the shift;
+ *   - NGX_SLAB_EXACT: chunks of exactly `ngx_slab_exact_size`, a page 
+ *     holds as many of them as `slab` has bits, so it's the bitmap;
+ *   - NGX_SLAB_SMALL: smaller chunks, the bitmap takes the first chunks 
+ *     of the page itself, `slab` holds the shift;
+ *   - NGX_SLAB_FINE (64-bit only, headers are 8 byte aligned there, so 
+ *     there's a third bit): chunks of an intermediate size class, see 
+ *     `ngx_slab_init_fine()`, the bitmap takes the lower bits of `slab`, 
+ *     the index of the class its highest byte.
+ */
+#define NGX_SLAB_PAGE        0
+#define NGX_SLAB_BIG         1
+#define NGX_SLAB_EXACT       2
+#define NGX_SLAB_SMALL       3
 
 
 #if (NGX_PTR_SIZE == 4)
 
+#define NGX_SLAB_PAGE_MASK   3
+
+#define NGX_SLAB_PAGE_FREE   0
+#define NGX_SLAB_PAGE_BUSY   0xffffffff /* page following the first one of a multi-page allocation */
 #define NGX_SLAB_PAGE_START  0x80000000 /* 32 bits with the highest bit set */
 
-#define NGX_SLAB_MAP_SHIFT   16         // TODO!!!!!!!!!!!!!!!!!!!!!
+#define NGX_SLAB_SHIFT_MASK  0x0000000f
+#define NGX_SLAB_MAP_MASK    0xffff0000
+#define NGX_SLAB_MAP_SHIFT   16
+
+#define NGX_SLAB_BUSY        0xffffffff /* all chunks of a bitmap word are taken */
+
+#define NGX_SLAB_HAVE_FINE   0
 
 #else /* (NGX_PTR_SIZE == 8) */
 
+#define NGX_SLAB_PAGE_MASK   7
+#define NGX_SLAB_FINE        4
+
+#define NGX_SLAB_PAGE_FREE   0
+#define NGX_SLAB_PAGE_BUSY   0xffffffffffffffff
 #define NGX_SLAB_PAGE_START  0x8000000000000000 /* 64 bits with the highest bit set */
+
+#define NGX_SLAB_SHIFT_MASK  0x000000000000000f
 #define NGX_SLAB_MAP_MASK    0xffffffff00000000 /* 32 highest bits set */
-#define NGX_SLAB_MAP_SHIFT   32                 // TODO!!!!!!!!!!!!!!!!!!!!!
+#define NGX_SLAB_MAP_SHIFT   32
+
+#define NGX_SLAB_BUSY        0xffffffffffffffff
+
+#define NGX_SLAB_HAVE_FINE   1
+#define NGX_SLAB_FINE_SHIFT  56
+#define NGX_SLAB_FINE_MAP    0x00ffffffffffffff /* at most 51 chunks of 80 bytes in a 4KiB page */
+
+#endif
+
+
+/**
+ * ngx_slab_ffs gives the index of the lowest set bit of a non-zero word, 
+ * so a free chunk of a bitmap word `w` is at `ngx_slab_ffs(~w)`.
+ */
+#if (NGX_HAVE_BUILTIN_CTZ)
+
+#define ngx_slab_ffs(w)      ((ngx_uint_t) __builtin_ctzl((unsigned long) (w)))
+
+#else
+
+static ngx_inline ngx_uint_t ngx_slab_ffs(uintptr_t w) {
+    ngx_uint_t  i;
+
+    for (i = 0; !(w & 1); w >>= 1, i++) { /* void */ }
+
+    return i;
+}
 
 #endif
 
 
+/*
+ * Locks of a striped pool are laid out a cache line pair apart, so that 
+ * workers hammering different slots don't bounce each other's lines.
+ */
+#define NGX_SLAB_LOCK_SIZE   ngx_align(sizeof(ngx_slab_lock_t), 128)
+
+#define ngx_slab_lock_at(pool, n)                                             \
+    ((ngx_slab_lock_t *) ((u_char *) (pool)->locks + (n) * NGX_SLAB_LOCK_SIZE))
+
+
 /* get start address of slab slots first slab page, just after the last byte of the slab pool struct) */
 #define ngx_slab_slots(pool)                                                  \
     (ngx_slab_page_t *) ((u_char *) (pool) + sizeof(ngx_slab_pool_t))
@@ -34,6 +109,14 @@
     ((((page) - (pool)->pages) << ngx_pagesize_shift)                         \
      + (uintptr_t) (pool)->start)
 
+/* chunk size of a slot, kept in its list head's otherwise unused `slab` */
+#define ngx_slab_slot_size(pool, slot)   ((size_t) (ngx_slab_slots(pool))[slot].slab)
+
+#define ngx_slab_page_type(page)   ((page)->prev & NGX_SLAB_PAGE_MASK)
+
+#define ngx_slab_page_prev(page)                                              \
+    (ngx_slab_page_t *) ((page)->prev & ~NGX_SLAB_PAGE_MASK)
+
 
 #if (NGX_DEBUG_MALLOC)
 
@@ -51,6 +134,40 @@
 #endif
 
 
+static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages);
+static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page, ngx_uint_t pages);
+static ngx_inline ngx_uint_t ngx_slab_bin(ngx_uint_t pages);
+static ngx_inline ngx_uint_t ngx_slab_bin_first(uint64_t map);
+static void ngx_slab_link_run(ngx_slab_pool_t *pool, ngx_slab_page_t *page);
+static void ngx_slab_unlink_run(ngx_slab_pool_t *pool, ngx_slab_page_t *page);
+static ngx_uint_t ngx_slab_largest_run(ngx_slab_pool_t *pool);
+static void ngx_slab_init_locks(ngx_slab_pool_t *pool, ngx_uint_t n);
+static ngx_inline void ngx_slab_lock(ngx_shmtx_t *mtx, ngx_uint_t *contended);
+static ngx_inline ngx_uint_t ngx_slab_slot(ngx_slab_pool_t *pool, size_t size, ngx_uint_t *shift);
+static void *ngx_slab_alloc_chunk(ngx_slab_pool_t *pool, ngx_uint_t slot, ngx_uint_t shift);
+static ngx_slab_page_t *ngx_slab_chunk(ngx_slab_pool_t *pool, void *p, ngx_uint_t *type, ngx_uint_t *slot);
+static ngx_int_t ngx_slab_free_chunk(ngx_slab_pool_t *pool, ngx_slab_page_t *page, void *p, ngx_uint_t type, ngx_uint_t slot);
+#if (NGX_SLAB_HAVE_FINE)
+static ngx_uint_t ngx_slab_init_fine(ngx_slab_pool_t *pool, ngx_slab_page_t *slots);
+static void *ngx_slab_alloc_fine(ngx_slab_pool_t *pool, ngx_uint_t slot);
+#endif
+static ngx_slab_magazines_t *ngx_slab_magazine(ngx_slab_pool_t *pool);
+static void *ngx_slab_magazine_alloc(ngx_slab_pool_t *pool, size_t size);
+static void ngx_slab_magazine_free(ngx_slab_pool_t *pool, void *p);
+static void ngx_slab_magazine_lock(ngx_slab_pool_t *pool, ngx_slab_magazine_t *mag, ngx_uint_t slot);
+static void ngx_slab_magazine_unlock(ngx_slab_pool_t *pool, ngx_uint_t slot);
+static void ngx_slab_magazine_refill(ngx_slab_pool_t *pool, ngx_slab_magazine_t *mag, ngx_uint_t slot, ngx_uint_t shift);
+static void ngx_slab_magazine_flush(ngx_slab_pool_t *pool, ngx_slab_magazine_t *mag, ngx_uint_t slot, ngx_uint_t n);
+static ngx_inline ngx_uint_t ngx_slab_scan(uintptr_t *bitmap, ngx_uint_t n, ngx_uint_t map);
+static void *ngx_slab_alloc_try(ngx_slab_pool_t *pool, size_t size);
+static ngx_uint_t ngx_slab_evict(ngx_slab_pool_t *pool, ngx_uint_t pages);
+static ngx_int_t ngx_slab_free_remote(ngx_slab_pool_t *pool, void *p);
+static void ngx_slab_drain(ngx_slab_pool_t *pool, ngx_uint_t slot);
+static ngx_int_t ngx_slab_check_page(ngx_slab_pool_t *pool, ngx_slab_page_t *page, ngx_uint_t *slot, ngx_uint_t *chunks, ngx_uint_t *taken);
+static ngx_inline ngx_uint_t ngx_slab_popcount(uintptr_t w);
+static void ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level, char *text);
+
+
 static ngx_uint_t  ngx_slab_max_size;    /* 2KiB on Linux */
 static ngx_uint_t  ngx_slab_exact_size;  /* 64, TODO!!!!! what unit is this? */
 static ngx_uint_t  ngx_slab_exact_shift; /* On Linux we get `ngx_slab_exact_shift` equal to 7 */
@@ -68,10 +185,10 @@ void ngx_slab_sizes_init(void) {
 
 
 void ngx_slab_init(ngx_slab_pool_t *pool) {
-    u_char           *p;
-    size_t            size;
+    u_char           *p, *l;
+    size_t            size, len;
     ngx_int_t         m;
-    ngx_uint_t        i, n, pages;
+    ngx_uint_t        i, n, pages, max;
     ngx_slab_page_t  *slots, *page;
 
     /**
@@ -121,14 +238,26 @@ void ngx_slab_init(ngx_slab_pool_t *pool) {
          * TODO!!!!!
          * 
          * Only "next" is used in list head, which points to the page 
-         * header struct itself.
+         * header struct itself, `slab` holds the size of the slot's chunks.
          */
 
-        slots[i].slab = 0;          /* TODO!!!!! number of slab pages? */           
+        slots[i].slab = (uintptr_t) 1 << (i + pool->min_shift);
         slots[i].next = &slots[i];
         slots[i].prev = 0;          /* TODO!!!!! previous slab header? */
     }
 
+    /* intermediate size classes follow the power of two ones */
+
+    pool->fine_slot = n;
+
+#if (NGX_SLAB_HAVE_FINE)
+    if (pool->fine) {
+        n += ngx_slab_init_fine(pool, slots);
+    }
+#endif
+
+    pool->nslots = n;
+
     /**
      * TODO!!!!!
      * 
@@ -151,23 +280,81 @@ void ngx_slab_init(ngx_slab_pool_t *pool) {
 
     size -= n * ((sizeof(ngx_slab_page_t)) + sizeof(ngx_slab_stat_t)); /* get remaining size after setting up the slab headers array and the slab stats array */
 
-    pages = (ngx_uint_t) (size / (ngx_pagesize + sizeof(ngx_slab_page_t))); /* calculate number of pages consiting of data and slab page header that can fit after slab stats array */
+    /**
+     * A striped pool (the caller sets `pool->striped` before calling us) gets 
+     * a lock per slot plus one for the free pages list right after the stats, 
+     * see `ngx_slab_init_locks()`.
+     */
+    pool->locks = NULL;
+
+    if (pool->striped) {
+        l = ngx_align_ptr(p, 128);
+        len = (l - p) + (n + 1) * NGX_SLAB_LOCK_SIZE;
+
+        if (len < size) {
+            pool->locks = (ngx_slab_lock_t *) l;
+
+            p += len;
+            size -= len;
+        }
+    }
+
+    /**
+     * A pool with remote frees (`pool->remote`, see `ngx_slab_free_remote()`) 
+     * gets a stack per slot after the stats (or locks), and the owner of every 
+     * page after the page headers.
+     */
+    pool->rfree = NULL;
+    pool->owners = NULL;
+
+    len = pool->remote ? sizeof(ngx_pid_t) : 0;
+
+    if (pool->remote) {
+        pool->rfree = (ngx_atomic_t *) p;
+        ngx_memzero((void *) pool->rfree, n * sizeof(ngx_atomic_t));
+
+        p += n * sizeof(ngx_atomic_t);
+        size -= n * sizeof(ngx_atomic_t);
+    }
+
+    pages = (ngx_uint_t) (size / (ngx_pagesize + sizeof(ngx_slab_page_t) + len)); /* calculate number of pages consiting of data and slab page header that can fit after slab stats array */
+
+    /**
+     * A zone which may grow later on (`pool->limit` set past `pool->end`, 
+     * see `ngx_slab_resize()`) gets page headers for the whole reserve up 
+     * front, as long as they take no more than half of its current size.
+     */
+    max = pages;
+
+    if (pool->limit > pool->end) {
+        max = (ngx_uint_t) ((size + (pool->limit - pool->end)) / (ngx_pagesize + sizeof(ngx_slab_page_t) + len));
+        max = ngx_min(max, (size / 2) / (sizeof(ngx_slab_page_t) + len));
+        max = ngx_max(max, pages);
+    }
 
     pool->pages = (ngx_slab_page_t *) p; /* get pointer to first element of slab page list */
-    ngx_memzero(pool->pages, pages * sizeof(ngx_slab_page_t));
+    ngx_memzero(pool->pages, max * sizeof(ngx_slab_page_t));
+
+    if (pool->remote) {
+        pool->owners = (ngx_pid_t *) (p + max * sizeof(ngx_slab_page_t));
+        ngx_memzero(pool->owners, max * sizeof(ngx_pid_t));
+    }
 
     page = pool->pages; /* pointer to first slab page header after slab page stats */
 
-    /* only "next" is used in list head */
-    pool->free.slab = 0;
-    pool->free.next = page;               /* free points to the slab page header after slab page stats, this header points to page? */
-    pool->free.prev = 0;
+    /* only "next" is used in list heads, all the bins start out empty */
+    for (i = 0; i < NGX_SLAB_BINS; i++) {
+        pool->free[i].slab = 0;
+        pool->free[i].next = &pool->free[i];
+        pool->free[i].prev = 0;
+    }
+
+    pool->binmap = 0;
+    pool->pruns = 0;
 
     page->slab = pages;                   /* TODO!!!!! number of pages consiting of data and slab page header that can fit after slab stats array? */
-    page->next = &pool->free;             /* TODO!!!!!points to it's slab page header? */
-    page->prev = (uintptr_t) &pool->free;
 
-    pool->start = ngx_align_ptr(p + (pages * sizeof(ngx_slab_page_t)), ngx_pagesize); /* align pointer to shared pages start address up to a multiple of 4096 bytes on Linux */
+    pool->start = ngx_align_ptr(p + max * (sizeof(ngx_slab_page_t) + len), ngx_pagesize); /* align pointer to shared pages start address up to a multiple of 4096 bytes on Linux */
 
     m = pages - ((pool->end - pool->start) / ngx_pagesize); /* TODO!!!!! is there enough place for the actual data pages, or is there less memory left for data pages than page headers  */
     if (m > 0) {
@@ -178,125 +365,282 @@ void ngx_slab_init(ngx_slab_pool_t *pool) {
     pool->last = pool->pages + pages; /* TODO!!!!! */
     pool->pfree = pages;
 
+    if (pool->limit == NULL || pool->limit > pool->start + max * ngx_pagesize) {
+        pool->limit = pool->start + max * ngx_pagesize;
+    }
+
+    ngx_slab_link_run(pool, page);        /* the whole zone is a single free run */
+
     pool->log_nomem = 1;
     pool->log_ctx = &pool->zero;
     pool->zero = '\0';
+
+    pool->pcontended = 0;
+
+    /* the zone's owner sets up eviction after `ngx_slab_init()` */
+    pool->low = 0;
+    pool->high = 0;
+    pool->evict = NULL;
+    pool->evict_data = NULL;
+    pool->evicting = 0;
+
+    if (pool->locks) {
+        ngx_slab_init_locks(pool, n);
+    }
 }
 
-// first alloc, requested size 1KiB
-void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size) {
-    size_t             s;
-    uintptr_t          p, m, mask;
-    ngx_uint_t         i, slot, shift;
-    ngx_slab_page_t   *page, *slots;
 
+#if (NGX_SLAB_HAVE_FINE)
 
-    /**
-     * Size class        Slot     Shift
-     * 8-15 bytes        0        3
-     * 16-31 bytes       1        4
-     * 32-63 bytes       2        5
-     * 64-127 bytes      3        6
-     * 128-255 bytes     4        7
-     * 256-511 bytes     5        8
-     * 512-1023 bytes    6        9
-     * 1024-2047 bytes   7        10
-     * 2048-4095 bytes   8        11             
-     */
+/**
+ * ngx_slab_init_fine sets up the slots of the intermediate size classes, 
+ * three between every two powers of two from the exact size up to half a 
+ * page, so that sizes are at most 1.25 times apart: 80, 96, 112, 160, 192, 
+ * 224, ..., 1280, 1536 and 1792 bytes with 4KiB pages. Smaller chunks waste 
+ * at most a few bytes each anyway. Returns the number of slots.
+ */
+static ngx_uint_t ngx_slab_init_fine(ngx_slab_pool_t *pool, ngx_slab_page_t *slots) {
+    size_t      base;
+    ngx_uint_t  i, n;
 
-    if (size > pool->min_size) {
-        shift = 1;
-        for (s = size -1; s >> 1; shift++) { /* void */ } /* for first and second alloc with request size of 1KiB shift becomes 10 */
-        slot = shift - pool->min_shift;                   /* 10 - 3, 7th page index */
-    } else {
-        shift = pool->min_size;
+    n = pool->fine_slot;
+
+    for (base = ngx_slab_exact_size; base < ngx_slab_max_size; base <<= 1) {
+        for (i = 1; i < 4; i++, n++) {
+            slots[n].slab = base + i * (base >> 2);
+            slots[n].next = &slots[n];
+            slots[n].prev = 0;
+        }
     }
 
-    pool->stats[slot].reqs++
+    return n - pool->fine_slot;
+}
 
-    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab alloc: %uz slot: %ui", size, slot);
+#endif
 
-    slots = ngx_slab_slots(pool);
 
-    /** 
-     * On first allocation returns pointer to slots[slot], 8th slot page header points to it .
-     * 
-     * On 2nd-4th allocation returns pointer to page allocated on first allocation.
-     */
-    page = slots[slot].next; 
+/**
+ * ngx_slab_reattach takes over a zone initialized by a previous run, which 
+ * a file-backed zone keeps across restarts (see `ngx_shm_alloc_file()`, 
+ * `shm->exists` is set then), instead of `ngx_slab_init()`. Everything in 
+ * the zone is where it was, but the semaphores of its locks and function 
+ * pointers into the previous binary are not: the caller creates `pool->mutex` 
+ * as for a fresh zone and sets up eviction again.
+ */
+void ngx_slab_reattach(ngx_slab_pool_t *pool) {
+    pool->evict = NULL;
+    pool->evict_data = NULL;
+    pool->evicting = 0;
 
-    if (page->next != page) {
-        /* on 2nd -4th allocation page->next is &slots[slot] and page is equal to page allocated on first allocation */
+    if (pool->locks) {
+        ngx_slab_init_locks(pool, pool->nslots);
+    }
+}
 
-        if (shift < ngx_slab_exact_shift) { /* on 2nd-4th allocation of a 1KiB chunk shift is 10 and ngx_slab_exact_shift is  7 */
-            // TODO!!!!!!!!!!!!!!!!!!!!!!!!!
-        } else if (shift == ngx_slab_exact_shift) { /* on 2nd-4th allocation of a 1KiB chunk shift is 10 and ngx_slab_exact_shift is  7 */
 
-            for (m = 1, i = 0; m; m <<= 1, i++) { /* 64 iterations, m has it's bits set to 1 from right to left with each new iteration */
-                // TODO!!!!!!
-            }
+/**
+ * ngx_slab_init_locks sets up the locks of a striped pool: one per slot, 
+ * guarding the slot's list of partially used pages along with the bitmaps 
+ * of those pages and the slot's stats, and one more (the last one) guarding 
+ * the list of free pages and `pfree`. 
+ * 
+ * Lock order is slot lock, then the free pages lock, the latter is only taken 
+ * when a slot needs a fresh page or gives an empty one back, and while a page 
+ * changes from or to NGX_SLAB_PAGE. A caller's own `pool->mutex` (protecting, 
+ * say, a module's rbtree) comes before both, so a striped pool can still be 
+ * used with `ngx_slab_alloc_locked()` under `pool->mutex`. 
+ * 
+ * The locks live in the shared zone itself, just like `pool->mutex` does, so 
+ * they're created once (before fork()) and work across all workers. If one of 
+ * them can't be created the pool falls back to the single `pool->mutex`.
+ */
+static void ngx_slab_init_locks(ngx_slab_pool_t *pool, ngx_uint_t n) {
+    ngx_uint_t        i;
+    ngx_slab_lock_t  *lock;
 
-        } else { /* shift > ngx_slab_exact_shift */
-            
-            /* on 2nd-4th allocation of a 1KiB chunk shift is 10 and ngx_slab_exact_shift is  7 */
+    for (i = 0; i <= n; i++) {
+        lock = ngx_slab_lock_at(pool, i);
 
-            mask = ((uintptr_t) 1 << (ngx_pagesize >> shift)) - 1; /* on 2nd-4th allocation of a 1KiB chunk has the 4 lower bits set */
-            mask << NGX_SLAB_MAP_SHIFT;                            /* on 2nd-4th allocation of a 1KiB chunk has bits 33 to 36 set */
+        ngx_memzero(lock, sizeof(ngx_slab_lock_t));
 
-            for (m = (uintptr_t) 1 << NGX_SLAB_MAP_SHIFT, i = 0; m & mask; m << 1, i++) { /* 4 iterations for set bits 33 to 36 in mask */
-                if (page->slab & m) {
-                    /* we skip bits 33 to 35 on 2nd and 3rd allocations, because page->slab has bits 33-35 set from previous allocations of a 1KiB chunk */
-                    continue;
-                }
+        lock->mutex.spin = 2048;
+
+        if (ngx_shmtx_create(&lock->mutex, &lock->sh, NULL) != NGX_OK) {
+            ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_init(): lock striping disabled");
+            pool->locks = NULL;
+            return;
+        }
+    }
+}
 
-                page->slab |= m; /* on 4th iteration set 36th bit in page->slab, signifying that the second 1KiB from this page is about to be allocated */
 
-                if ((page->slab & NGX_SLAB_MAP_MASK) == mask) {
-                    /* True only 4th allocation, because page->slab has bits 33 to 36 set */
-                    // prev = ngx_slab_page_prev()
-                } 
+/* take the lock, counting the acquisitions which had to wait */
+static ngx_inline void ngx_slab_lock(ngx_shmtx_t *mtx, ngx_uint_t *contended) {
+    if (ngx_shmtx_trylock(mtx)) {
+        return;
+    }
 
-                /** 
-                 * ngx_slab_page_addr returns (pool)->start and for i = 1, shift = 10 i << shift return s 1024, 
-                 * so p points to the second 1024 bytes chunk
-                 */
-                p = ngx_slab_page_addr(pool, page) + (i << shift);
+    ngx_shmtx_lock(mtx);
 
-                pool->stats[slot].used++;
+    (*contended)++;
+}
 
-                goto done;
-            }
+
+#define ngx_slab_lock_slot(pool, slot)                                        \
+    do {                                                                      \
+        if ((pool)->locks) {                                                  \
+            ngx_slab_lock(&ngx_slab_lock_at(pool, slot)->mutex,               \
+                          &(pool)->stats[slot].contended);                    \
+        }                                                                     \
+    } while (0)
+
+#define ngx_slab_unlock_slot(pool, slot)                                      \
+    do {                                                                      \
+        if ((pool)->locks) {                                                  \
+            ngx_shmtx_unlock(&ngx_slab_lock_at(pool, slot)->mutex);           \
+        }                                                                     \
+    } while (0)
+
+#define ngx_slab_lock_pages(pool)                                             \
+    do {                                                                      \
+        if ((pool)->locks) {                                                  \
+            ngx_slab_lock(&ngx_slab_lock_at(pool, (pool)->nslots)->mutex,     \
+                          &(pool)->pcontended);                               \
+        }                                                                     \
+    } while (0)
+
+#define ngx_slab_unlock_pages(pool)                                           \
+    do {                                                                      \
+        if ((pool)->locks) {                                                  \
+            ngx_shmtx_unlock(&ngx_slab_lock_at(pool, (pool)->nslots)->mutex); \
+        }                                                                     \
+    } while (0)
+
+/**
+ * ngx_slab_alloc allocates from a zone which may be shared between workers: 
+ * from the process' magazine if the zone has them, otherwise under 
+ * `pool->mutex`, or, for striped pools, under the locks of the slot (and 
+ * the free pages list) it actually touches.
+ */
+void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size) {
+    void  *p;
+
+    if (pool->local) {
+        return ngx_slab_alloc_locked(pool, size);
+    }
+
+    if (pool->magazines && size <= ngx_slab_max_size) {
+        return ngx_slab_magazine_alloc(pool, size);
+    }
+
+    if (pool->locks) {
+        return ngx_slab_alloc_locked(pool, size);
+    }
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    p = ngx_slab_alloc_locked(pool, size);
+
+    ngx_shmtx_unlock(&pool->mutex);
+
+    return p;
+}
+
+
+/**
+ * ngx_slab_alloc_locked is called with `pool->mutex` held (or by a single 
+ * process). Requests bigger than half a page are served by whole pages, 
+ * everything else by chunks of the nearest power of two carved out of pages 
+ * kept on the slot's list (see `ngx_slab_alloc_chunk()`):
+ * 
+ * Size class        Slot     Shift
+ * 1-8 bytes         0        3
+ * 9-16 bytes        1        4
+ * 17-32 bytes       2        5
+ * 33-64 bytes       3        6
+ * 65-128 bytes      4        7
+ * 129-256 bytes     5        8
+ * 257-512 bytes     6        9
+ * 513-1024 bytes    7        10
+ * 1025-2048 bytes   8        11
+ * 
+ * With `pool->fine` set, sizes above the exact size go to the smallest of 
+ * the intermediate classes which fits instead, if any (see `ngx_slab_slot()`), 
+ * so a 1025 byte request takes a 1280 byte chunk rather than a 2KiB one. 
+ * 
+ * A zone with an eviction handler (see `ngx_slab_evict()`) has it called 
+ * once the free pages drop below `pool->low`, and when an allocation fails, 
+ * which is then retried once.
+ */
+void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size) {
+    void  *p;
+
+    p = ngx_slab_alloc_try(pool, size);
+
+    if (pool->evict == NULL) {
+        return p;
+    }
+
+    if (p == NULL) {
+        if (ngx_slab_evict(pool, size > ngx_slab_max_size ? (size + ngx_pagesize - 1) >> ngx_pagesize_shift : 1)) {
+            p = ngx_slab_alloc_try(pool, size);
         }
+
+    } else if (pool->pfree < pool->low) {
+        (void) ngx_slab_evict(pool, 0);
     }
 
-    page = ngx_slab_alloc_pages(pool, 1); /* "pop" page header struct for page at index 0 */
+    return p;
+}
 
-    if (page) {
-        if (shift < ngx_slab_exact_shift) {
-           // TODO!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-        } else if (shift == ngx_slab_exact_shift) {
-            // TODO!!!!!!!!!!!!!!!!!!!!!!
-        } else { /* shift > ngx_slab_exact_shift */
 
-            /* for first alloc with request size of 1KiB shift 10 is greater than ngx_slab_exact_shift 7 */
+static void *ngx_slab_alloc_try(ngx_slab_pool_t *pool, size_t size) {
+    uintptr_t          p;
+    ngx_uint_t         slot, shift;
+    ngx_slab_page_t   *page;
 
-            page->slab = ((uintptr_t) 1 << NGX_SLAB_MAP_SHIFT) | shift; /* 33rd bit set and 2nd and 4th bits set TODO!!!!! */
-            page->next = &slots[slot];                                  /* on first alloc with requested size 1KiB, this will be the pointer to 8th page */
-            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_BIG;       /* on first alloc with requested size 1KiB, this will be the address of the 8th page with the lowest bit set */
+    if (size > ngx_slab_max_size) {
 
-            slots[slot].next = page; // TODO!!!!! point 8th pages next atrribute at allocated page
+        ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab alloc: %uz", size);
 
-            pool->stats[slot].total += ngx_pagesize >> shift;           /* +4 on first alloc with requested size 1KiB (4 * 1KiB in 4096 bytes page) */
+        ngx_slab_lock_pages(pool);
 
-            p = ngx_slab_page_addr(pool, page);                         /* on first allocation of a single page at index 0 will be equal to (pool)->start */
+        page = ngx_slab_alloc_pages(pool, (size >> ngx_pagesize_shift) + ((size % ngx_pagesize) ? 1 : 0));
 
-            pool->stats[slot].used++;                                   /* 1 out of 4 1KiB chunks used */
+        ngx_slab_unlock_pages(pool);
 
-            goto done;
+        if (page) {
+            p = ngx_slab_page_addr(pool, page);
+
+        } else {
+            p = 0;
         }
+
+        goto done;
+    }
+
+    slot = ngx_slab_slot(pool, size, &shift);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab alloc: %uz slot: %ui", size, slot);
+
+    ngx_slab_lock_slot(pool, slot);
+
+    if (pool->rfree) {
+        ngx_slab_drain(pool, slot);
+    }
+
+    pool->stats[slot].reqs++;
+
+    p = (uintptr_t) ngx_slab_alloc_chunk(pool, slot, shift);
+
+    if (p) {
+        pool->stats[slot].requested += size;
+
+    } else {
+        pool->stats[slot].fails++;
     }
 
-    // TODO!!!!!!!!!
+    ngx_slab_unlock_slot(pool, slot);
 
 done:
 
@@ -306,77 +650,1976 @@ done:
 }
 
 
-static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages) {
-    ngx_slab_page_t   *page, *p;
+/**
+ * ngx_slab_evict calls the zone's eviction handler to get the free pages 
+ * back up to `pool->high`, or at least `pages` up, e.g. a cache dropping 
+ * the tail of its LRU queue. The handler gets the number of pages wanted 
+ * and frees entries with `ngx_slab_free_locked()` until it has reclaimed 
+ * about that many (chunks only give their page back once it's empty), 
+ * returning the number of pages it thinks it freed, 0 if it couldn't. 
+ * 
+ * It's called with `pool->mutex` held, or, for striped pools, with no slab 
+ * lock held at all, as the handler takes the slot locks itself. A single 
+ * process evicts at a time, `pool->evicting` holds its pid meanwhile, which 
+ * also keeps the handler's own allocations from recursing. If that process 
+ * dies mid-eviction the slot is cleared by `ngx_slab_force_unlock()`.
+ */
+static ngx_uint_t ngx_slab_evict(ngx_slab_pool_t *pool, ngx_uint_t pages) {
+    ngx_uint_t  n, target;
 
-    /**
-     * On first allocation of a single page there will be only one iteration
-     * with page = pool->free.next, where page->next == &pool->free.
+    target = (pool->high > pool->pfree) ? pool->high - pool->pfree : 0;
+
+    if (target < pages) {
+        target = pages;
+    }
+
+    if (target == 0) {
+        return 0;
+    }
+
+    if (!ngx_atomic_cmp_set(&pool->evicting, 0, ngx_pid)) {
+        return 0;
+    }
+
+    n = pool->evict(pool, target, pool->evict_data);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
+                   "slab evict: %ui of %ui pages, free: %ui", n, target, pool->pfree);
+
+    ngx_memory_barrier();
+
+    pool->evicting = 0;
+
+    return n;
+}
+
+
+/**
+ * ngx_slab_force_unlock releases everything a dead process may have held in 
+ * a shared zone: the zone mutex, the slot and page locks of a striped zone, 
+ * and the eviction slot, which would otherwise keep eviction off for the rest 
+ * of the zone's life. It's meant for the master's dead worker path, in place 
+ * of the bare `ngx_shmtx_force_unlock(&sp->mutex, pid)` done for every zone 
+ * (`ngx_unlock_mutexes()`). 
+ * 
+ * Returns 1 if anything was held by `pid`, so the caller can log an alert. 
+ * The zone itself may be left inconsistent by an allocation cut short, see 
+ * `ngx_slab_check()`.
+ */
+ngx_uint_t ngx_slab_force_unlock(ngx_slab_pool_t *pool, ngx_pid_t pid) {
+    ngx_uint_t  i, n, locked;
+
+    if (pool->local) {
+        return 0;
+    }
+
+    locked = ngx_shmtx_force_unlock(&pool->mutex, pid);
+
+    if (pool->locks) {
+        n = pool->nslots + 1; /* the page lock comes right after the slot locks */
+
+        for (i = 0; i < n; i++) {
+            locked |= ngx_shmtx_force_unlock(&ngx_slab_lock_at(pool, i)->mutex, pid);
+        }
+    }
+
+    if (ngx_atomic_cmp_set(&pool->evicting, (ngx_atomic_uint_t) pid, 0)) {
+        locked = 1;
+    }
+
+    return locked;
+}
+
+
+/**
+ * ngx_slab_slot gives the slot of the smallest chunks big enough for `size`, 
+ * which is at most `ngx_slab_max_size`. A size between two powers of two 
+ * 2^(n-1) and 2^n above the exact size falls into one of the quarters of 
+ * 2^(n-1) in between, the first three of which are intermediate classes. 
+ */
+static ngx_inline ngx_uint_t ngx_slab_slot(ngx_slab_pool_t *pool, size_t size, ngx_uint_t *shift) {
+    size_t      s;
+    ngx_uint_t  n, q;
+
+    if (size <= pool->min_size) {
+        *shift = pool->min_shift;
+        return 0;
+    }
+
+    n = 1;
+    for (s = size - 1; s >>= 1; n++) { /* void */ } /* for a request of 1KiB shift becomes 10 */
+
+    *shift = n;
+
+    if (pool->fine_slot < pool->nslots && n > ngx_slab_exact_shift) {
+        q = (size - 1 - ((size_t) 1 << (n - 1))) >> (n - 3); /* 1025 bytes: (1024 - 1024) / 256, the 1280 byte class */
+
+        if (q < 3) {
+            return pool->fine_slot + (n - 1 - ngx_slab_exact_shift) * 3 + q;
+        }
+    }
+
+    return n - pool->min_shift;                     /* 10 - 3, 8th slot (index 7) */
+}
+
+
+/**
+ * ngx_slab_alloc_chunk takes a chunk from the slot, with the slot locked 
+ * (or `pool->mutex` held). Only pages with free chunks are kept on a slot's 
+ * list, a page is unlinked as soon as its last chunk is taken, so the head 
+ * page always has room; if there's none, a fresh page is taken. 
+ * 
+ * Accounts the chunk in the slot's `used` and `total`, but not in `reqs` 
+ * and `fails`, which count the callers' requests.
+ */
+static void *ngx_slab_alloc_chunk(ngx_slab_pool_t *pool, ngx_uint_t slot, ngx_uint_t shift) {
+    uintptr_t          p, m, mask, *bitmap;
+    ngx_uint_t         i, n, map;
+    ngx_slab_page_t   *page, *prev, *slots;
+
+#if (NGX_SLAB_HAVE_FINE)
+    if (slot >= pool->fine_slot) {
+        return ngx_slab_alloc_fine(pool, slot);
+    }
+#endif
+
+    slots = ngx_slab_slots(pool);
+
+    /** 
+     * The slot's list head points at itself while the slot has no pages 
+     * with free chunks. 
      */
-    for (page = pool->free.next; page != &pool->free; page = page->next) { 
-        if (page->slab >= pages) {
-
-            /** 
-             * On first allocation of a single page, 
-             * page->slab will be greater than pages, 
-             * which is equal to 1.  
-             * 
-             * page->slab is TODO!!!!!
+    page = slots[slot].next; 
+
+    if (page->next != page) {
+
+        if (shift < ngx_slab_exact_shift) {
+
+            /**
+             * Small chunks: the bitmap doesn't fit into `page->slab` and 
+             * takes the first chunks of the page itself (marked as busy).
              */
+            bitmap = (uintptr_t *) ngx_slab_page_addr(pool, page);
+
+            map = (ngx_pagesize >> shift) / (8 * sizeof(uintptr_t)); /* bitmap words */
+
+            n = ngx_slab_scan(bitmap, 0, map);
+
+            if (n < map) {
+                i = ngx_slab_ffs(~bitmap[n]);
+                bitmap[n] |= (uintptr_t) 1 << i;
+
+                i = (n * 8 * sizeof(uintptr_t) + i) << shift;
+
+                p = (uintptr_t) bitmap + i;
+
+                pool->stats[slot].used++;
+
+                if (bitmap[n] == NGX_SLAB_BUSY && ngx_slab_scan(bitmap, n + 1, map) == map) {
+
+                    /* the page is full, unlink it from the slot */
+
+                    prev = ngx_slab_page_prev(page);
+                    prev->next = page->next;
+                    page->next->prev = page->prev;
+
+                    page->next = NULL;
+                    page->prev = NGX_SLAB_SMALL;
+                }
+
+                return (void *) p;
+            }
+
+        } else if (shift == ngx_slab_exact_shift) {
+
+            /* exact chunks: as many per page as `page->slab` has bits, it's the bitmap */
+
+            if (page->slab != NGX_SLAB_BUSY) {
+                i = ngx_slab_ffs(~page->slab);
+                page->slab |= (uintptr_t) 1 << i;
+
+                if (page->slab == NGX_SLAB_BUSY) {
+                    prev = ngx_slab_page_prev(page);
+                    prev->next = page->next;
+                    page->next->prev = page->prev;
+
+                    page->next = NULL;
+                    page->prev = NGX_SLAB_EXACT;
+                }
 
-            if (page->slab > pages) {
-                 /**
-                 * On first allocation with pages = 1, point last
-                 * page header's prev attribute to page at index 1.
-                 */
-                page[page->slab - 1].prev = (uintptr_t) &page[pages];
-
-                /**
-                 * On first allocation with pages = 1, update page at index 1 
-                 * to have the number of available free pages decremented by 1 
-                 */
-                page[pages].slab = page->slab - pages; 
-
-                /**
-                 * On first allocation with pages = 1, update page at index 1 
-                 * to point at &pool->free through the next attribute.
-                 */
-                page[pages].next = page->next;
-
-
-                /**
-                 * On first allocation with pages = 1, update page at index 1 
-                 * to point at &pool->free through the prev attribute.
-                 */
-                page[pages].prev = page->prev;
-
-
-                p = (ngx_slab_page_t *) page->prev; /* cast uintptr_t to pointer to page header, which is &pool->free on first allocation */
-                p->next = page->next;               /* point (&pool->free)'s next attribute back to itself */
-                page->next->prev = page->prev;      /* point (&pool->free)'s prev attribute back to itself */
-            } else {
-                // TODO!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+                pool->stats[slot].used++;
+
+                return (void *) (ngx_slab_page_addr(pool, page) + (i << shift));
             }
 
-            page->slab = pages | NGX_SLAB_PAGE_START; // TODO!!!!!!!!!!!!!!! updates page at index 0 (sets slab atrribute of allocated page to 0)
+        } else { /* shift > ngx_slab_exact_shift */
+
             /**
-             * On first allocation page at index 0 gets allocated, 
-             * prune all of its pointer attributes 
+             * Big chunks: the bitmap takes the upper half of `page->slab`, 
+             * e.g. for 1KiB chunks a page holds 4 of them, so `mask` has 
+             * bits 32 to 35 set.
              */
-            page->next = NULL;                        
-            page->prev = NGX_SLAB_PAGE; /* set to 0 */
+            mask = ((uintptr_t) 1 << (ngx_pagesize >> shift)) - 1;
+            mask <<= NGX_SLAB_MAP_SHIFT;
+
+            m = ~page->slab & mask;
+
+            if (m) {
+                i = ngx_slab_ffs(m) - NGX_SLAB_MAP_SHIFT;
+                page->slab |= (uintptr_t) 1 << (i + NGX_SLAB_MAP_SHIFT);
+
+                if ((page->slab & NGX_SLAB_MAP_MASK) == mask) {
+                    prev = ngx_slab_page_prev(page);
+                    prev->next = page->next;
+                    page->next->prev = page->prev;
 
-            pool->pfree -= pages; /* decrement count of free pages */
+                    page->next = NULL;
+                    page->prev = NGX_SLAB_BIG;
+                }
+
+                pool->stats[slot].used++;
 
-            if (--pages == 0) {
-                /** 
-                 * On first allocation just the 0th page is allocated 
-                 * so return it straight away 
-                 */
-                return page;
+                /* for i = 1 and shift = 10, this is the second 1KiB chunk of the page */
+                return (void *) (ngx_slab_page_addr(pool, page) + (i << shift));
             }
+        }
+
+        ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_alloc(): page is busy");
+    }
+
+    /**
+     * The slot has no page with free chunks, take a fresh one. Its header 
+     * is set up under the free pages lock as well: that's where pages change 
+     * from NGX_SLAB_PAGE, which `ngx_slab_free_pages()` relies on when it 
+     * looks at neighbours while coalescing.
+     */
+    ngx_slab_lock_pages(pool);
+
+    page = ngx_slab_alloc_pages(pool, 1);
+
+    if (page) {
+        if (shift < ngx_slab_exact_shift) {
+            page->slab = shift;
+            page->next = &slots[slot];
+            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_SMALL;
+
+        } else if (shift == ngx_slab_exact_shift) {
+            page->slab = 1;
+            page->next = &slots[slot];
+            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_EXACT;
 
-            // TODO!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+        } else { /* shift > ngx_slab_exact_shift */
+            page->slab = ((uintptr_t) 1 << NGX_SLAB_MAP_SHIFT) | shift; /* first chunk taken, shift in the low bits */
+            page->next = &slots[slot];
+            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_BIG;
         }
     }
-}
\ No newline at end of file
+
+    ngx_slab_unlock_pages(pool);
+
+    if (page == NULL) {
+        return NULL;
+    }
+
+    if (pool->owners) {
+        pool->owners[page - pool->pages] = ngx_pid;
+    }
+
+    slots[slot].next = page;
+
+    if (shift < ngx_slab_exact_shift) {
+        bitmap = (uintptr_t *) ngx_slab_page_addr(pool, page);
+
+        /* chunks taken by the bitmap itself */
+
+        n = (ngx_pagesize >> shift) / ((1 << shift) * 8);
+
+        if (n == 0) {
+            n = 1;
+        }
+
+        /* "n" elements for bitmap, plus one requested */
+
+        for (i = 0; i < (n + 1) / (8 * sizeof(uintptr_t)); i++) {
+            bitmap[i] = NGX_SLAB_BUSY;
+        }
+
+        m = ((uintptr_t) 1 << ((n + 1) % (8 * sizeof(uintptr_t)))) - 1;
+        bitmap[i] = m;
+
+        map = (ngx_pagesize >> shift) / (8 * sizeof(uintptr_t));
+
+        for (i = i + 1; i < map; i++) {
+            bitmap[i] = 0;
+        }
+
+        pool->stats[slot].total += (ngx_pagesize >> shift) - n;
+
+        p = ngx_slab_page_addr(pool, page) + (n << shift);
+
+    } else if (shift == ngx_slab_exact_shift) {
+        pool->stats[slot].total += 8 * sizeof(uintptr_t);
+
+        p = ngx_slab_page_addr(pool, page);
+
+    } else { /* shift > ngx_slab_exact_shift */
+        pool->stats[slot].total += ngx_pagesize >> shift;  /* +4 for 1KiB chunks */
+
+        p = ngx_slab_page_addr(pool, page);
+    }
+
+    pool->stats[slot].used++;
+
+    return (void *) p;
+}
+
+
+#if (NGX_SLAB_HAVE_FINE)
+
+/**
+ * ngx_slab_alloc_fine is `ngx_slab_alloc_chunk()` for the intermediate size 
+ * classes. Their chunks aren't a power of two, so a page holds 
+ * `ngx_pagesize / size` of them with a few bytes left over at its end, 
+ * never more than 51, the bitmap fits into `slab` below the class index.
+ */
+static void *ngx_slab_alloc_fine(ngx_slab_pool_t *pool, ngx_uint_t slot) {
+    size_t            size;
+    uintptr_t         m, mask;
+    ngx_uint_t        i;
+    ngx_slab_page_t  *page, *prev, *slots;
+
+    slots = ngx_slab_slots(pool);
+    size = ngx_slab_slot_size(pool, slot);
+    mask = ((uintptr_t) 1 << (ngx_pagesize / size)) - 1;
+
+    page = slots[slot].next;
+
+    if (page->next != page) {
+        m = ~page->slab & mask;
+
+        if (m) {
+            i = ngx_slab_ffs(m);
+            page->slab |= (uintptr_t) 1 << i;
+
+            if ((page->slab & NGX_SLAB_FINE_MAP) == mask) {
+                prev = ngx_slab_page_prev(page);
+                prev->next = page->next;
+                page->next->prev = page->prev;
+
+                page->next = NULL;
+                page->prev = NGX_SLAB_FINE;
+            }
+
+            pool->stats[slot].used++;
+
+            return (void *) (ngx_slab_page_addr(pool, page) + i * size);
+        }
+
+        ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_alloc(): page is busy");
+    }
+
+    ngx_slab_lock_pages(pool);
+
+    page = ngx_slab_alloc_pages(pool, 1);
+
+    if (page) {
+        page->slab = ((uintptr_t) (slot - pool->fine_slot) << NGX_SLAB_FINE_SHIFT) | 1;
+        page->next = &slots[slot];
+        page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_FINE;
+    }
+
+    ngx_slab_unlock_pages(pool);
+
+    if (page == NULL) {
+        return NULL;
+    }
+
+    if (pool->owners) {
+        pool->owners[page - pool->pages] = ngx_pid;
+    }
+
+    slots[slot].next = page;
+
+    pool->stats[slot].total += ngx_pagesize / size;
+    pool->stats[slot].used++;
+
+    return (void *) ngx_slab_page_addr(pool, page);
+}
+
+#endif
+
+
+/**
+ * ngx_slab_scan gives the index of the first word of a small chunks bitmap, 
+ * starting at `n`, which has a free chunk, or `map` if there's none. Only the 
+ * smallest classes have bitmaps longer than a couple of words (8 of them for 
+ * 8 byte chunks in a 4KiB page), AVX2 checks 4 words at a time.
+ */
+static ngx_inline ngx_uint_t ngx_slab_scan(uintptr_t *bitmap, ngx_uint_t n, ngx_uint_t map) {
+#if (NGX_HAVE_AVX2 && NGX_PTR_SIZE == 8)
+    int      busy;
+    __m256i  w, ones;
+
+    ones = _mm256_set1_epi64x(-1);
+
+    for ( /* void */ ; n + 4 <= map; n += 4) {
+        w = _mm256_loadu_si256((__m256i *) &bitmap[n]);
+
+        /* a bit per word which is all ones */
+        busy = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(w, ones)));
+
+        if (busy != 0xf) {
+            return n + ngx_slab_ffs(~busy & 0xf);
+        }
+    }
+#endif
+
+    for ( /* void */ ; n < map; n++) {
+        if (bitmap[n] != NGX_SLAB_BUSY) {
+            return n;
+        }
+    }
+
+    return map;
+}
+
+
+void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size) {
+    void  *p;
+
+    p = ngx_slab_alloc(pool, size);
+    if (p) {
+        ngx_memzero(p, size);
+    }
+
+    return p;
+}
+
+
+void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size) {
+    void  *p;
+
+    p = ngx_slab_alloc_locked(pool, size);
+    if (p) {
+        ngx_memzero(p, size);
+    }
+
+    return p;
+}
+
+
+/**
+ * ngx_slab_alloc_n allocates `n` blocks of `sizes[i]` bytes into `ptrs[i]`, 
+ * taking `pool->mutex` just once, for building compound objects in a zone. 
+ * It's all or nothing: if one of them fails, the ones already allocated are 
+ * freed, `ptrs` are all set to NULL and NGX_ERROR is returned. Striped pools 
+ * and magazines don't lock the zone as a whole, the blocks are taken one 
+ * by one then, as they are from a private pool.
+ */
+ngx_int_t ngx_slab_alloc_n(ngx_slab_pool_t *pool, size_t *sizes, void **ptrs, ngx_uint_t n) {
+    ngx_uint_t  i;
+
+    if (pool->local || pool->magazines || pool->locks) {
+
+        for (i = 0; i < n; i++) {
+            ptrs[i] = ngx_slab_alloc(pool, sizes[i]);
+
+            if (ptrs[i] == NULL) {
+                ngx_slab_free_n(pool, ptrs, i);
+                goto failed;
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    for (i = 0; i < n; i++) {
+        ptrs[i] = ngx_slab_alloc_locked(pool, sizes[i]);
+
+        if (ptrs[i] == NULL) {
+            while (i--) {
+                ngx_slab_free_locked(pool, ptrs[i]);
+            }
+
+            ngx_shmtx_unlock(&pool->mutex);
+
+            goto failed;
+        }
+    }
+
+    ngx_shmtx_unlock(&pool->mutex);
+
+    return NGX_OK;
+
+failed:
+
+    for (i = 0; i < n; i++) {
+        ptrs[i] = NULL;
+    }
+
+    return NGX_ERROR;
+}
+
+
+void ngx_slab_free(ngx_slab_pool_t *pool, void *p) {
+    if (pool->local) {
+        ngx_slab_free_locked(pool, p);
+        return;
+    }
+
+    if (pool->magazines) {
+        ngx_slab_magazine_free(pool, p);
+        return;
+    }
+
+    if (pool->rfree && ngx_slab_free_remote(pool, p) == NGX_OK) {
+        return;
+    }
+
+    if (pool->locks) {
+        ngx_slab_free_locked(pool, p);
+        return;
+    }
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    ngx_slab_free_locked(pool, p);
+
+    ngx_shmtx_unlock(&pool->mutex);
+}
+
+
+/**
+ * Remote frees
+ * ============
+ * A chunk freed by a process other than the one which took its page for 
+ * the slot would have that process wait for the zone's (or slot's) lock 
+ * only to touch pages which are hot in another worker's cache. In a zone 
+ * with `pool->remote` set, such a chunk is pushed onto its slot's lock-free 
+ * stack instead, linked through its first word, and the next allocation 
+ * from the slot, which holds the lock anyway, gives the whole stack back 
+ * in a batch (see `ngx_slab_drain()`). 
+ * 
+ * The page headers have no room left for the owner, so the owners of pages 
+ * are kept in an array of their own, and the stacks are per slot rather 
+ * than per page: a page's owner is just the one most likely to allocate 
+ * from its slot again. Stacks are only ever pushed to or taken as a whole, 
+ * so there's no ABA problem. Chunks on a stack still count as used.
+ */
+static ngx_int_t ngx_slab_free_remote(ngx_slab_pool_t *pool, void *p) {
+    ngx_uint_t         type, slot;
+    ngx_atomic_t      *stack;
+    ngx_slab_page_t   *page;
+    ngx_atomic_uint_t  head;
+
+    page = ngx_slab_chunk(pool, p, &type, &slot);
+
+    if (page == NULL) {
+        return NGX_OK; /* already logged */
+    }
+
+    if (type == NGX_SLAB_PAGE || pool->owners[page - pool->pages] == ngx_pid) {
+        return NGX_DECLINED;
+    }
+
+    ngx_slab_junk(p, ngx_slab_slot_size(pool, slot));
+
+    stack = &pool->rfree[slot];
+
+    do {
+        head = *stack;
+        *(ngx_atomic_uint_t *) p = head;
+
+    } while (!ngx_atomic_cmp_set(stack, head, (ngx_atomic_uint_t) p));
+
+    return NGX_OK;
+}
+
+
+/**
+ * ngx_slab_drain frees the chunks remotely freed into the slot, with the slot 
+ * locked (or `pool->mutex` held). A chunk freed twice would make the stack 
+ * loop, so no more chunks are taken than the slot has, and the walk stops at 
+ * the first chunk which is already free: the rest of the stack can't be told 
+ * from the loop, it's dropped (leaked) rather than freed twice.
+ */
+static void ngx_slab_drain(ngx_slab_pool_t *pool, ngx_uint_t slot) {
+    void              *c;
+    ngx_uint_t         n, type, s;
+    ngx_slab_page_t   *page;
+    ngx_atomic_uint_t  p, next;
+
+    do {
+        p = pool->rfree[slot];
+
+        if (p == 0) {
+            return;
+        }
+
+    } while (!ngx_atomic_cmp_set(&pool->rfree[slot], p, 0));
+
+    for (n = pool->stats[slot].total; p && n; p = next, n--) {
+        c = (void *) p;
+        next = *(ngx_atomic_uint_t *) c;
+
+        page = ngx_slab_chunk(pool, c, &type, &s);
+
+        if (page && ngx_slab_free_chunk(pool, page, c, type, slot) != NGX_OK) {
+            return; /* already logged */
+        }
+    }
+
+    if (p) {
+        ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_free(): remote free loop, chunk freed twice");
+    }
+}
+
+
+/* ngx_slab_free_n frees `n` blocks, taking `pool->mutex` once, NULL ones are skipped */
+void ngx_slab_free_n(ngx_slab_pool_t *pool, void **ptrs, ngx_uint_t n) {
+    ngx_uint_t  i;
+
+    if (pool->local || pool->magazines || pool->locks) {
+
+        for (i = 0; i < n; i++) {
+            if (ptrs[i]) {
+                ngx_slab_free(pool, ptrs[i]);
+            }
+        }
+
+        return;
+    }
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    for (i = 0; i < n; i++) {
+        if (ptrs[i]) {
+            ngx_slab_free_locked(pool, ptrs[i]);
+        }
+    }
+
+    ngx_shmtx_unlock(&pool->mutex);
+}
+
+
+/**
+ * ngx_slab_free_locked finds the page header of the chunk by its offset from 
+ * `pool->start`, and its slot from the page header (see `ngx_slab_chunk()`). 
+ * Chunks go back to their slot (see `ngx_slab_free_chunk()`), pages straight 
+ * to the free pages list.
+ */
+void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p) {
+    size_t            size;
+    uintptr_t         slab;
+    ngx_uint_t        type, slot;
+    ngx_slab_page_t  *page;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab free: %p", p);
+
+    page = ngx_slab_chunk(pool, p, &type, &slot);
+
+    if (page == NULL) {
+        return;
+    }
+
+    if (type == NGX_SLAB_PAGE) {
+
+        ngx_slab_lock_pages(pool);
+
+        slab = page->slab;
+
+        if (!(slab & NGX_SLAB_PAGE_START)) {
+            ngx_slab_unlock_pages(pool);
+            ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_free(): page is already free");
+            return;
+        }
+
+        if (slab == NGX_SLAB_PAGE_BUSY) {
+            ngx_slab_unlock_pages(pool);
+            ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_free(): pointer to wrong page");
+            return;
+        }
+
+        size = slab & ~NGX_SLAB_PAGE_START;
+
+        ngx_slab_free_pages(pool, page, size);
+
+        ngx_slab_unlock_pages(pool);
+
+        ngx_slab_junk(p, size << ngx_pagesize_shift);
+
+        return;
+    }
+
+    ngx_slab_lock_slot(pool, slot);
+
+    if (ngx_slab_free_chunk(pool, page, p, type, slot) != NGX_OK) {
+        ngx_slab_unlock_slot(pool, slot);
+        return;
+    }
+
+    ngx_slab_unlock_slot(pool, slot);
+
+    ngx_slab_junk(p, ngx_slab_slot_size(pool, slot));
+}
+
+
+/**
+ * ngx_slab_chunk validates a pointer to be freed and returns its page header 
+ * along with the page type and, for chunks, their slot. Those are stable 
+ * while the chunk is allocated, so they're read without the slot lock.
+ */
+static ngx_slab_page_t *ngx_slab_chunk(ngx_slab_pool_t *pool, void *p, ngx_uint_t *type, ngx_uint_t *slot) {
+    ngx_uint_t        n, shift;
+    ngx_slab_page_t  *page;
+
+    if ((u_char *) p < pool->start || (u_char *) p > pool->end) {
+        ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_free(): outside of pool");
+        return NULL;
+    }
+
+    n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
+    page = &pool->pages[n];
+    *type = ngx_slab_page_type(page);
+
+    switch (*type) {
+
+    case NGX_SLAB_SMALL:
+    case NGX_SLAB_BIG:
+        shift = page->slab & NGX_SLAB_SHIFT_MASK;
+        break;
+
+    case NGX_SLAB_EXACT:
+        shift = ngx_slab_exact_shift;
+        break;
+
+#if (NGX_SLAB_HAVE_FINE)
+    case NGX_SLAB_FINE:
+        *slot = pool->fine_slot + (page->slab >> NGX_SLAB_FINE_SHIFT);
+
+        if (((uintptr_t) p & (ngx_pagesize - 1)) % ngx_slab_slot_size(pool, *slot) == 0) {
+            return page;
+        }
+
+        goto wrong_chunk;
+#endif
+
+    default: /* NGX_SLAB_PAGE */
+        shift = ngx_pagesize_shift;
+        break;
+    }
+
+    *slot = shift - pool->min_shift;
+
+    if ((uintptr_t) p & (((uintptr_t) 1 << shift) - 1)) {
+        goto wrong_chunk;
+    }
+
+    return page;
+
+wrong_chunk:
+
+    ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_free(): pointer to wrong chunk");
+
+    return NULL;
+}
+
+
+/**
+ * ngx_slab_free_chunk gives a chunk back to its slot, with the slot locked 
+ * (or `pool->mutex` held). A page which had no free chunks goes back onto 
+ * the slot's list, an empty one goes back to the free pages.
+ */
+static ngx_int_t ngx_slab_free_chunk(ngx_slab_pool_t *pool, ngx_slab_page_t *page, void *p, ngx_uint_t type, ngx_uint_t slot) {
+    uintptr_t         slab, m, *bitmap;
+    ngx_uint_t        i, n, map, shift;
+#if (NGX_SLAB_HAVE_FINE)
+    size_t            size;
+#endif
+    ngx_slab_page_t  *slots;
+
+    shift = slot + pool->min_shift; /* unless it's one of the intermediate classes */
+    slots = ngx_slab_slots(pool);
+
+    slab = page->slab;
+
+    switch (type) {
+
+    case NGX_SLAB_SMALL:
+
+        n = ((uintptr_t) p & (ngx_pagesize - 1)) >> shift;
+        m = (uintptr_t) 1 << (n % (8 * sizeof(uintptr_t)));
+        n /= 8 * sizeof(uintptr_t);
+        bitmap = (uintptr_t *) ((uintptr_t) p & ~((uintptr_t) ngx_pagesize - 1));
+
+        if (!(bitmap[n] & m)) {
+            goto chunk_already_free;
+        }
+
+        if (page->next == NULL) {
+            page->next = slots[slot].next;
+            slots[slot].next = page;
+
+            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_SMALL;
+            page->next->prev = (uintptr_t) page | NGX_SLAB_SMALL;
+        }
+
+        bitmap[n] &= ~m;
+
+        /* the chunks taken by the bitmap itself stay busy */
+
+        n = (ngx_pagesize >> shift) / ((1 << shift) * 8);
+
+        if (n == 0) {
+            n = 1;
+        }
+
+        i = n / (8 * sizeof(uintptr_t));
+        m = ((uintptr_t) 1 << (n % (8 * sizeof(uintptr_t)))) - 1;
+
+        if (bitmap[i] & ~m) {
+            goto done;
+        }
+
+        map = (ngx_pagesize >> shift) / (8 * sizeof(uintptr_t));
+
+        for (i = i + 1; i < map; i++) {
+            if (bitmap[i]) {
+                goto done;
+            }
+        }
+
+        ngx_slab_lock_pages(pool);
+        ngx_slab_free_pages(pool, page, 1);
+        ngx_slab_unlock_pages(pool);
+
+        pool->stats[slot].total -= (ngx_pagesize >> shift) - n;
+
+        goto done;
+
+    case NGX_SLAB_EXACT:
+
+        m = (uintptr_t) 1 << (((uintptr_t) p & (ngx_pagesize - 1)) >> ngx_slab_exact_shift);
+
+        if (!(slab & m)) {
+            goto chunk_already_free;
+        }
+
+        if (slab == NGX_SLAB_BUSY) {
+            page->next = slots[slot].next;
+            slots[slot].next = page;
+
+            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_EXACT;
+            page->next->prev = (uintptr_t) page | NGX_SLAB_EXACT;
+        }
+
+        page->slab &= ~m;
+
+        if (page->slab) {
+            goto done;
+        }
+
+        ngx_slab_lock_pages(pool);
+        ngx_slab_free_pages(pool, page, 1);
+        ngx_slab_unlock_pages(pool);
+
+        pool->stats[slot].total -= 8 * sizeof(uintptr_t);
+
+        goto done;
+
+#if (NGX_SLAB_HAVE_FINE)
+    case NGX_SLAB_FINE:
+
+        size = ngx_slab_slot_size(pool, slot);
+
+        m = (uintptr_t) 1 << (((uintptr_t) p & (ngx_pagesize - 1)) / size);
+
+        if (!(slab & m)) {
+            goto chunk_already_free;
+        }
+
+        if (page->next == NULL) {
+            page->next = slots[slot].next;
+            slots[slot].next = page;
+
+            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_FINE;
+            page->next->prev = (uintptr_t) page | NGX_SLAB_FINE;
+        }
+
+        page->slab &= ~m;
+
+        if (page->slab & NGX_SLAB_FINE_MAP) {
+            goto done;
+        }
+
+        ngx_slab_lock_pages(pool);
+        ngx_slab_free_pages(pool, page, 1);
+        ngx_slab_unlock_pages(pool);
+
+        pool->stats[slot].total -= ngx_pagesize / size;
+
+        goto done;
+#endif
+
+    default: /* NGX_SLAB_BIG */
+
+        m = (uintptr_t) 1 << ((((uintptr_t) p & (ngx_pagesize - 1)) >> shift) + NGX_SLAB_MAP_SHIFT);
+
+        if (!(slab & m)) {
+            goto chunk_already_free;
+        }
+
+        if (page->next == NULL) {
+            page->next = slots[slot].next;
+            slots[slot].next = page;
+
+            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_BIG;
+            page->next->prev = (uintptr_t) page | NGX_SLAB_BIG;
+        }
+
+        page->slab &= ~m;
+
+        if (page->slab & NGX_SLAB_MAP_MASK) {
+            goto done;
+        }
+
+        ngx_slab_lock_pages(pool);
+        ngx_slab_free_pages(pool, page, 1);
+        ngx_slab_unlock_pages(pool);
+
+        pool->stats[slot].total -= ngx_pagesize >> shift;
+
+        goto done;
+    }
+
+done:
+
+    pool->stats[slot].used--;
+
+    return NGX_OK;
+
+chunk_already_free:
+
+    ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_free(): chunk is already free");
+
+    return NGX_ERROR;
+}
+
+
+/**
+ * ngx_slab_create_private creates a pool of `size` bytes (at least 8 pages) 
+ * in the process' own heap, for long-lived objects of a single process, e.g. 
+ * a worker's timers or connection metadata, which outlive any request pool. 
+ * Such a pool (`pool->local`) never locks: `pool->mutex` isn't even created, 
+ * `ngx_slab_alloc()` and `ngx_slab_free()` go straight to the `_locked` 
+ * variants. Striped locks and magazines make no sense there and are off.
+ */
+ngx_slab_pool_t *ngx_slab_create_private(size_t size, ngx_log_t *log) {
+    ngx_slab_pool_t  *pool;
+
+    size = ngx_max(ngx_align(size, ngx_pagesize), 8 * ngx_pagesize);
+
+    pool = ngx_alloc(size, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(pool, sizeof(ngx_slab_pool_t));
+
+    pool->end = (u_char *) pool + size;
+    pool->min_shift = 3;
+    pool->addr = pool;
+    pool->local = 1;
+
+    ngx_slab_init(pool);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0, "slab private: %p:%uz", pool, size);
+
+    return pool;
+}
+
+
+void ngx_slab_destroy_private(ngx_slab_pool_t *pool) {
+    ngx_free(pool->addr);
+}
+
+
+/**
+ * Per-process magazines
+ * =====================
+ * Chunks are mostly freed by the worker which allocated them, shortly after. 
+ * A zone with `pool->magazines` set (before the workers start) keeps, in every 
+ * process, a small stack of free chunks per slot in process-local memory. 
+ * `ngx_slab_alloc()` and `ngx_slab_free()` pop and push them without touching 
+ * the zone's locks at all; an empty magazine is refilled, and a full one half 
+ * flushed, in a batch under a single lock acquisition. Chunks of any process 
+ * may end up in any magazine, it's all the same shared memory. 
+ * 
+ * The zone's stats don't count chunks sitting in magazines as used, and every 
+ * process keeps the `reqs` and `used` deltas of what it served locally, which 
+ * are folded into `ngx_slab_stat_t` whenever it takes the lock anyway, so the 
+ * stats lag by at most a batch per process. 
+ * 
+ * Chunks in a magazine are lost to the zone if the process dies without calling 
+ * `ngx_slab_magazines_flush()`, e.g. when a worker crashes, at most 
+ * NGX_SLAB_MAGAZINE_SIZE per slot. A magazine filled before fork() is dropped 
+ * by the child (the parent still owns those chunks), see `ngx_slab_magazine()`. 
+ * The `_locked` variants never use magazines.
+ */
+
+static ngx_slab_magazines_t  *ngx_slab_magazines_list;
+
+
+/* the calling process' magazines of the zone, created on first use */
+static ngx_slab_magazines_t *ngx_slab_magazine(ngx_slab_pool_t *pool) {
+    ngx_slab_magazines_t  *mags;
+
+    for (mags = ngx_slab_magazines_list; mags; mags = mags->next) {
+        if (mags->pool == pool) {
+            break;
+        }
+    }
+
+    if (mags && mags->pid != ngx_pid) {
+        /* inherited from the parent, whose chunks these are */
+        ngx_memzero(mags->slots, pool->nslots * sizeof(ngx_slab_magazine_t));
+        mags->pid = ngx_pid;
+    }
+
+    if (mags) {
+        return mags;
+    }
+
+    mags = ngx_calloc(sizeof(ngx_slab_magazines_t) + pool->nslots * sizeof(ngx_slab_magazine_t), ngx_cycle->log);
+    if (mags == NULL) {
+        return NULL;
+    }
+
+    mags->pool = pool;
+    mags->pid = ngx_pid;
+    mags->slots = (ngx_slab_magazine_t *) &mags[1];
+
+    mags->next = ngx_slab_magazines_list;
+    ngx_slab_magazines_list = mags;
+
+    return mags;
+}
+
+
+static void *ngx_slab_magazine_alloc(ngx_slab_pool_t *pool, size_t size) {
+    void                  *p;
+    ngx_uint_t             slot, shift;
+    ngx_slab_magazine_t   *mag;
+    ngx_slab_magazines_t  *mags;
+
+    mags = ngx_slab_magazine(pool);
+
+    if (mags == NULL) {
+        goto locked;
+    }
+
+    slot = ngx_slab_slot(pool, size, &shift);
+    mag = &mags->slots[slot];
+
+    if (mag->n == 0) {
+        ngx_slab_magazine_refill(pool, mag, slot, shift);
+
+        if (mag->n == 0) {
+            /* out of pages, the locked path counts the failure and evicts */
+            goto locked;
+        }
+    }
+
+    p = mag->chunks[--mag->n];
+
+    mag->reqs++;
+    mag->used++;
+    mag->requested += size;
+
+    return p;
+
+locked:
+
+    if (pool->locks) {
+        return ngx_slab_alloc_locked(pool, size);
+    }
+
+    ngx_shmtx_lock(&pool->mutex);
+    p = ngx_slab_alloc_locked(pool, size);
+    ngx_shmtx_unlock(&pool->mutex);
+
+    return p;
+}
+
+
+static void ngx_slab_magazine_free(ngx_slab_pool_t *pool, void *p) {
+    ngx_uint_t             type, slot;
+    ngx_slab_page_t       *page;
+    ngx_slab_magazine_t   *mag;
+    ngx_slab_magazines_t  *mags;
+
+    page = ngx_slab_chunk(pool, p, &type, &slot);
+
+    if (page == NULL) {
+        return;
+    }
+
+    mags = ngx_slab_magazine(pool);
+
+    if (type == NGX_SLAB_PAGE || mags == NULL) {
+        if (pool->locks) {
+            ngx_slab_free_locked(pool, p);
+            return;
+        }
+
+        ngx_shmtx_lock(&pool->mutex);
+        ngx_slab_free_locked(pool, p);
+        ngx_shmtx_unlock(&pool->mutex);
+
+        return;
+    }
+
+    mag = &mags->slots[slot];
+
+    if (mag->n == NGX_SLAB_MAGAZINE_SIZE) {
+        ngx_slab_magazine_flush(pool, mag, slot, NGX_SLAB_MAGAZINE_SIZE / 2);
+    }
+
+    ngx_slab_junk(p, ngx_slab_slot_size(pool, slot));
+
+    mag->chunks[mag->n++] = p;
+    mag->used--;
+}
+
+
+/* lock the slot (or the zone), fold the magazine's stats deltas in */
+static void ngx_slab_magazine_lock(ngx_slab_pool_t *pool, ngx_slab_magazine_t *mag, ngx_uint_t slot) {
+    if (pool->locks) {
+        ngx_slab_lock_slot(pool, slot);
+
+    } else {
+        ngx_shmtx_lock(&pool->mutex);
+    }
+
+    pool->stats[slot].reqs += mag->reqs;
+    pool->stats[slot].used += mag->used;
+    pool->stats[slot].requested += mag->requested;
+
+    mag->reqs = 0;
+    mag->used = 0;
+    mag->requested = 0;
+}
+
+
+static void ngx_slab_magazine_unlock(ngx_slab_pool_t *pool, ngx_uint_t slot) {
+    if (pool->locks) {
+        ngx_slab_unlock_slot(pool, slot);
+
+    } else {
+        ngx_shmtx_unlock(&pool->mutex);
+    }
+}
+
+
+/**
+ * ngx_slab_magazine_refill takes half a magazine worth of chunks from the slot. 
+ * They're counted as used by `ngx_slab_alloc_chunk()` and uncounted right away, 
+ * they're free as far as the zone's users are concerned.
+ */
+static void ngx_slab_magazine_refill(ngx_slab_pool_t *pool, ngx_slab_magazine_t *mag, ngx_uint_t slot, ngx_uint_t shift) {
+    void        *p;
+    ngx_uint_t   n;
+
+    ngx_slab_magazine_lock(pool, mag, slot);
+
+    if (pool->rfree) {
+        ngx_slab_drain(pool, slot);
+    }
+
+    for (n = 0; n < NGX_SLAB_MAGAZINE_SIZE / 2; n++) {
+        p = ngx_slab_alloc_chunk(pool, slot, shift);
+
+        if (p == NULL) {
+            break;
+        }
+
+        mag->chunks[mag->n++] = p;
+    }
+
+    pool->stats[slot].used -= n;
+
+    ngx_slab_magazine_unlock(pool, slot);
+
+    if (n && pool->evict && pool->pfree < pool->low) {
+        if (pool->locks) {
+            (void) ngx_slab_evict(pool, 0);
+            return;
+        }
+
+        ngx_shmtx_lock(&pool->mutex);
+        (void) ngx_slab_evict(pool, 0);
+        ngx_shmtx_unlock(&pool->mutex);
+    }
+}
+
+
+/* ngx_slab_magazine_flush gives `n` chunks from the top of the magazine back to the slot */
+static void ngx_slab_magazine_flush(ngx_slab_pool_t *pool, ngx_slab_magazine_t *mag, ngx_uint_t slot, ngx_uint_t n) {
+    void             *p;
+    ngx_uint_t        type, s;
+    ngx_slab_page_t  *page;
+
+    ngx_slab_magazine_lock(pool, mag, slot);
+
+    while (n-- && mag->n) {
+        p = mag->chunks[--mag->n];
+
+        page = ngx_slab_chunk(pool, p, &type, &s);
+
+        pool->stats[slot].used++; /* was uncounted when it went into the magazine */
+
+        (void) ngx_slab_free_chunk(pool, page, p, type, slot);
+    }
+
+    ngx_slab_magazine_unlock(pool, slot);
+}
+
+
+/**
+ * ngx_slab_magazines_flush gives every chunk held by the calling process' 
+ * magazines back to their zones, meant for a worker on its way out.
+ */
+void ngx_slab_magazines_flush(void) {
+    ngx_uint_t             i;
+    ngx_slab_magazines_t  *mags;
+
+    for (mags = ngx_slab_magazines_list; mags; mags = mags->next) {
+
+        if (mags->pid != ngx_pid) {
+            continue;
+        }
+
+        for (i = 0; i < mags->pool->nslots; i++) {
+            if (mags->slots[i].n || mags->slots[i].reqs || mags->slots[i].used) {
+                ngx_slab_magazine_flush(mags->pool, &mags->slots[i], i, NGX_SLAB_MAGAZINE_SIZE);
+            }
+        }
+    }
+}
+
+
+/**
+ * Free page runs are kept in NGX_SLAB_BINS lists by length: the first 
+ * NGX_SLAB_RUNS_EXACT bins hold runs of exactly 1, 2, ... NGX_SLAB_RUNS_EXACT 
+ * pages, each bin after them runs of 2^k to 2^(k+1) - 1 pages (the last one 
+ * everything longer), see `ngx_slab_bin()`. `pool->binmap` has a bit set 
+ * for every bin which isn't empty. 
+ * 
+ * ngx_slab_alloc_pages takes the head of the bin of `pages` if that's an 
+ * exact one, or else the head of the first non-empty bin above it, where 
+ * any run fits, so short runs, which is what the slots and most callers 
+ * ask for, take a lookup in `binmap` and no list walk. Only a request for 
+ * more than NGX_SLAB_RUNS_EXACT pages walks its own bin, which may hold 
+ * shorter runs as well, and takes the first run which fits, before it goes up. 
+ * 
+ * A longer run is split, its tail goes back into the bin of its new length. 
+ * The first page of the allocation is marked with NGX_SLAB_PAGE_START and the 
+ * number of pages, the rest of them as NGX_SLAB_PAGE_BUSY. 
+ * 
+ * A free run keeps its length in the first page header's `slab`, and its 
+ * last page header points back at the first one through `prev`, which is 
+ * how `ngx_slab_free_pages()` finds the start of the run preceding a page.
+ */
+static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages) {
+    uint64_t           map;
+    ngx_uint_t         b;
+    ngx_slab_page_t   *page, *p, *best;
+
+    b = ngx_slab_bin(pages);
+    best = NULL;
+
+    if (pages <= NGX_SLAB_RUNS_EXACT) {
+        if (pool->free[b].next != &pool->free[b]) {
+            best = pool->free[b].next;
+        }
+
+    } else {
+        for (page = pool->free[b].next; page != &pool->free[b]; page = page->next) {
+            if (page->slab >= pages) {
+                best = page;
+                break;
+            }
+        }
+    }
+
+    if (best == NULL && b < NGX_SLAB_BINS - 1) {
+        map = pool->binmap & ~(((uint64_t) 2 << b) - 1); /* the bins above `b` */
+
+        if (map) {
+            b = ngx_slab_bin_first(map);
+            best = pool->free[b].next;
+        }
+    }
+
+    if (best == NULL) {
+        if (pool->log_nomem) {
+            ngx_slab_error(pool, NGX_LOG_CRIT, "ngx_slab_alloc() failed: no memory");
+        }
+
+        return NULL;
+    }
+
+    page = best;
+
+    ngx_slab_unlink_run(pool, page);
+
+    if (page->slab > pages) {
+        /* the last page of the run points back at its new start */
+        page[page->slab - 1].prev = (uintptr_t) &page[pages];
+
+        page[pages].slab = page->slab - pages; 
+        ngx_slab_link_run(pool, &page[pages]);
+    }
+
+    page->slab = pages | NGX_SLAB_PAGE_START;
+    page->next = NULL;                        
+    page->prev = NGX_SLAB_PAGE;
+
+    pool->pfree -= pages; /* decrement count of free pages */
+
+    if (--pages == 0) {
+        return page;
+    }
+
+    for (p = page + 1; pages; pages--) {
+        p->slab = NGX_SLAB_PAGE_BUSY;
+        p->next = NULL;
+        p->prev = NGX_SLAB_PAGE;
+        p++;
+    }
+
+    return page;
+}
+
+
+/**
+ * ngx_slab_free_pages puts a run of pages back into the free bins, merging 
+ * it with the free runs right after and right before it, so the bins never 
+ * hold two adjacent runs. A page still linked into a slot's list is unlinked 
+ * first.
+ */
+static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page, ngx_uint_t pages) {
+    ngx_slab_page_t  *prev, *join;
+
+    pool->pfree += pages;
+
+    page->slab = pages--;
+
+    if (pages) {
+        ngx_memzero(&page[1], pages * sizeof(ngx_slab_page_t));
+    }
+
+    if (page->next) {
+        prev = ngx_slab_page_prev(page);
+        prev->next = page->next;
+        page->next->prev = page->prev;
+    }
+
+    join = page + page->slab;
+
+    if (join < pool->last) {
+
+        if (ngx_slab_page_type(join) == NGX_SLAB_PAGE) {
+
+            if (join->next != NULL) { /* only free runs are linked */
+                ngx_slab_unlink_run(pool, join);
+
+                pages += join->slab;
+                page->slab += join->slab;
+
+                join->slab = NGX_SLAB_PAGE_FREE;
+                join->next = NULL;
+                join->prev = NGX_SLAB_PAGE;
+            }
+        }
+    }
+
+    if (page > pool->pages) {
+        join = page - 1;
+
+        if (ngx_slab_page_type(join) == NGX_SLAB_PAGE) {
+
+            if (join->slab == NGX_SLAB_PAGE_FREE) {
+                join = ngx_slab_page_prev(join); /* the last page of a free run, go to its start */
+            }
+
+            if (join->next != NULL) {
+                ngx_slab_unlink_run(pool, join); /* while `slab` still tells its bin */
+
+                pages += join->slab;
+                join->slab += page->slab;
+
+                page->slab = NGX_SLAB_PAGE_FREE;
+                page->next = NULL;
+                page->prev = NGX_SLAB_PAGE;
+
+                page = join;
+            }
+        }
+    }
+
+    if (pages) {
+        page[pages].prev = (uintptr_t) page;
+    }
+
+    ngx_slab_link_run(pool, page);
+}
+
+
+/**
+ * ngx_slab_bin gives the bin of a free run of `pages` pages: `pages - 1` up 
+ * to NGX_SLAB_RUNS_EXACT pages, then one bin per power of two, the floor of log2 
+ * counted from NGX_SLAB_RUNS_EXACT_SHIFT on.
+ */
+static ngx_inline ngx_uint_t ngx_slab_bin(ngx_uint_t pages) {
+    ngx_uint_t  b;
+
+    if (pages <= NGX_SLAB_RUNS_EXACT) {
+        return pages - 1;
+    }
+
+    for (b = 0; pages >>= 1; b++) { /* void */ }
+
+    return ngx_min(NGX_SLAB_RUNS_EXACT + b - NGX_SLAB_RUNS_EXACT_SHIFT, NGX_SLAB_BINS - 1);
+}
+
+
+/* the lowest non-empty bin of a non-zero `binmap` */
+static ngx_inline ngx_uint_t ngx_slab_bin_first(uint64_t map) {
+#if (NGX_PTR_SIZE == 8)
+    return ngx_slab_ffs(map);
+#else
+    return (uint32_t) map ? ngx_slab_ffs((uint32_t) map) : 32 + ngx_slab_ffs((uint32_t) (map >> 32));
+#endif
+}
+
+
+/* ngx_slab_link_run puts a free run, `slab` set to its length, at the head of its bin */
+static void ngx_slab_link_run(ngx_slab_pool_t *pool, ngx_slab_page_t *page) {
+    ngx_uint_t        b;
+    ngx_slab_page_t  *head;
+
+    b = ngx_slab_bin(page->slab);
+    head = &pool->free[b];
+
+    page->prev = (uintptr_t) head;
+    page->next = head->next;
+
+    page->next->prev = (uintptr_t) page;
+
+    head->next = page;
+
+    pool->binmap |= (uint64_t) 1 << b;
+    pool->pruns++;
+}
+
+
+static void ngx_slab_unlink_run(ngx_slab_pool_t *pool, ngx_slab_page_t *page) {
+    ngx_uint_t        b;
+    ngx_slab_page_t  *prev;
+
+    prev = ngx_slab_page_prev(page);
+    prev->next = page->next;
+    page->next->prev = page->prev;
+
+    b = ngx_slab_bin(page->slab);
+
+    if (pool->free[b].next == &pool->free[b]) {
+        pool->binmap &= ~((uint64_t) 1 << b);
+    }
+
+    pool->pruns--;
+}
+
+
+/**
+ * ngx_slab_largest_run gives the length of the longest free run, which is 
+ * in the highest non-empty bin, the bin's length if it's an exact one. 
+ * Against `pool->pfree` it tells how badly the free pages are fragmented.
+ */
+static ngx_uint_t ngx_slab_largest_run(ngx_slab_pool_t *pool) {
+    ngx_uint_t        b, max;
+    ngx_slab_page_t  *page;
+
+    max = 0;
+
+    for (b = NGX_SLAB_BINS; b-- > 0; /* void */) {
+
+        if (!(pool->binmap & ((uint64_t) 1 << b))) {
+            continue;
+        }
+
+        if (b < NGX_SLAB_RUNS_EXACT) {
+            return b + 1;
+        }
+
+        for (page = pool->free[b].next; page != &pool->free[b]; page = page->next) {
+            if (page->slab > max) {
+                max = page->slab;
+            }
+        }
+
+        break;
+    }
+
+    return max;
+}
+
+
+/**
+ * ngx_slab_resize moves the end of the zone to `end`, within `pool->limit`: 
+ * new pages at the end are freed into the zone as a run, merged with a free 
+ * run right before them, shrinking only takes pages off a free run at the 
+ * very end of the zone. The memory itself is committed and given back by 
+ * the caller, before growing and after shrinking, e.g. with `ngx_shm_resize()`, 
+ * which gives the zone its reserve. 
+ * 
+ * Returns NGX_OK, or NGX_DECLINED if the zone couldn't shrink as much, the 
+ * actual end is in `pool->end` then, and NGX_ERROR if `end` is out of the 
+ * reserve.
+ */
+ngx_int_t ngx_slab_resize(ngx_slab_pool_t *pool, u_char *end) {
+    ngx_int_t         rc;
+    ngx_uint_t        pages, n;
+    ngx_slab_page_t  *page, *run;
+
+    if (end > pool->limit || end < pool->start + ngx_pagesize) {
+        ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_resize(): out of the zone's reserve");
+        return NGX_ERROR;
+    }
+
+    if (!pool->local && !pool->locks) {
+        ngx_shmtx_lock(&pool->mutex);
+    }
+
+    ngx_slab_lock_pages(pool);
+
+    rc = NGX_OK;
+    pages = (end - pool->start) >> ngx_pagesize_shift;
+    n = pool->last - pool->pages;
+
+    if (pages > n) {
+        page = pool->last;
+
+        ngx_memzero(page, (pages - n) * sizeof(ngx_slab_page_t));
+
+        if (pool->owners) {
+            ngx_memzero(&pool->owners[n], (pages - n) * sizeof(ngx_pid_t));
+        }
+
+        pool->last = pool->pages + pages;
+
+        ngx_slab_free_pages(pool, page, pages - n);
+
+    } else if (pages < n) {
+        page = pool->last - 1;
+
+        /* the last page is either a single free page or the last of a free run */
+        run = (page->slab == NGX_SLAB_PAGE_FREE) ? ngx_slab_page_prev(page) : page;
+
+        if (ngx_slab_page_type(page) != NGX_SLAB_PAGE || run->next == NULL) {
+            pages = n;          /* busy */
+
+        } else if (run - pool->pages > (ngx_int_t) pages) {
+            pages = run - pool->pages;
+        }
+
+        if (pages < n) {
+            ngx_slab_unlink_run(pool, run);
+
+            if (run < pool->pages + pages) {
+                /* what's left of the run, `slab` tells its new length */
+                run->slab = pool->pages + pages - run;
+                run[run->slab - 1].prev = (uintptr_t) run;
+                ngx_slab_link_run(pool, run);
+            }
+
+            pool->pfree -= n - pages;
+            pool->last = pool->pages + pages;
+        }
+
+        if (pool->start + (pages << ngx_pagesize_shift) > end) {
+            rc = NGX_DECLINED;
+        }
+    }
+
+    pool->end = pool->start + (pages << ngx_pagesize_shift);
+
+    ngx_slab_unlock_pages(pool);
+
+    if (!pool->local && !pool->locks) {
+        ngx_shmtx_unlock(&pool->mutex);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab resize: %ui pages, free: %ui", pages, pool->pfree);
+
+    return rc;
+}
+
+
+/**
+ * ngx_slab_check walks the whole zone and checks that its structures agree 
+ * with each other, logging every inconsistency at the "alert" level: 
+ *   - every page is either a free run, a whole page allocation (first page 
+ *     marked with the length, the rest as busy) or a page of chunks; 
+ *   - no two free runs are adjacent, the last page of a run points back 
+ *     at its start, and the runs found are exactly those in the bins, each 
+ *     in the right one, `binmap`, `pfree` and `pruns` agreeing; 
+ *   - a page of chunks is on its slot's list if and only if it has a free 
+ *     chunk, chunks never go beyond the page; 
+ *   - the slots' `total` match the pages they have, and `used` the chunks 
+ *     taken (chunks on the remote free stacks are both), or at most those 
+ *     if magazines keep some of them aside uncounted. 
+ * 
+ * Meant for debugging and stress testing, it takes time linear in the size 
+ * of the zone, the zone has to be quiescent: `pool->mutex` held, and for 
+ * striped pools, all the locks. Returns NGX_OK or NGX_ERROR.
+ */
+ngx_int_t ngx_slab_check(ngx_slab_pool_t *pool) {
+    ngx_int_t         rc;
+    ngx_uint_t        i, n, b, slot, chunks, used, nfree, runs, *total, *taken;
+    ngx_slab_page_t  *page, *p, *slots;
+
+#define ngx_slab_check_fail(text)                                             \
+    { ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_check(): " text); rc = NGX_ERROR; }
+
+    rc = NGX_OK;
+    slots = ngx_slab_slots(pool);
+
+    total = ngx_calloc(2 * pool->nslots * sizeof(ngx_uint_t), ngx_cycle->log);
+    if (total == NULL) {
+        return NGX_ERROR;
+    }
+
+    taken = total + pool->nslots;
+
+    nfree = 0;
+    runs = 0;
+
+    for (page = pool->pages; page < pool->last; page += n) {
+        n = 1;
+
+        if (ngx_slab_page_type(page) != NGX_SLAB_PAGE) {
+
+            if (ngx_slab_check_page(pool, page, &slot, &chunks, &used) != NGX_OK) {
+                rc = NGX_ERROR;
+            }
+
+            if (slot >= pool->nslots) {
+                ngx_slab_check_fail("page of chunks of no slot");
+                continue;
+            }
+
+            total[slot] += chunks;
+            taken[slot] += used;
+
+            continue;
+        }
+
+        if (page->slab & NGX_SLAB_PAGE_START) {
+
+            if (page->slab == NGX_SLAB_PAGE_BUSY) {
+                ngx_slab_check_fail("busy page without a start");
+                continue;
+            }
+
+            n = page->slab & ~NGX_SLAB_PAGE_START;
+
+            for (p = page + 1; p < page + n && p < pool->last; p++) {
+                if (p->slab != NGX_SLAB_PAGE_BUSY || ngx_slab_page_type(p) != NGX_SLAB_PAGE) {
+                    ngx_slab_check_fail("allocated run is cut short");
+                    n = p - page;
+                    break;
+                }
+            }
+
+            continue;
+        }
+
+        /* a free run */
+
+        n = page->slab;
+
+        if (n == 0 || page->next == NULL || page + n > pool->last) {
+            ngx_slab_check_fail("broken free run");
+            n = 1;
+            continue;
+        }
+
+        if (n > 1 && ngx_slab_page_prev(&page[n - 1]) != page) {
+            ngx_slab_check_fail("free run's last page doesn't point at its start");
+        }
+
+        if (page + n < pool->last 
+            && ngx_slab_page_type(&page[n]) == NGX_SLAB_PAGE 
+            && !(page[n].slab & NGX_SLAB_PAGE_START)) 
+        {
+            ngx_slab_check_fail("adjacent free runs");
+        }
+
+        nfree += n;
+        runs++;
+    }
+
+    if (nfree != pool->pfree) {
+        ngx_slab_check_fail("free pages don't match pfree");
+    }
+
+    if (runs != pool->pruns) {
+        ngx_slab_check_fail("free runs don't match pruns");
+    }
+
+    /* the bins hold the same runs */
+
+    for (b = 0; b < NGX_SLAB_BINS; b++) {
+        page = pool->free[b].next;
+
+        if ((page != &pool->free[b]) != ((pool->binmap >> b) & 1)) {
+            ngx_slab_check_fail("binmap doesn't match the bins");
+        }
+
+        for (i = 0; page != &pool->free[b]; page = page->next) {
+
+            if (page < pool->pages || page >= pool->last || ++i > pool->pruns) {
+                ngx_slab_check_fail("bin is broken");
+                break;
+            }
+
+            if (ngx_slab_bin(page->slab) != b) {
+                ngx_slab_check_fail("free run in a wrong bin");
+            }
+
+            runs--;
+        }
+    }
+
+    if (runs != 0) {
+        ngx_slab_check_fail("free runs don't match the bins");
+    }
+
+    /* the pages of chunks were checked above, here are the lists and stats */
+
+    for (slot = 0; slot < pool->nslots; slot++) {
+
+        i = 0;
+
+        for (page = slots[slot].next; page != &slots[slot]; page = page->next) {
+            if (page < pool->pages || page >= pool->last || ++i > (ngx_uint_t) (pool->last - pool->pages)) {
+                ngx_slab_check_fail("slot list is broken");
+                break;
+            }
+        }
+
+        if (pool->stats[slot].total != total[slot]) {
+            ngx_slab_check_fail("slot's total doesn't match its pages");
+        }
+
+        if (pool->magazines) {
+            if (pool->stats[slot].used > taken[slot]) {
+                ngx_slab_check_fail("slot's used is above the chunks taken");
+            }
+
+        } else if (pool->stats[slot].used != taken[slot]) {
+            ngx_slab_check_fail("slot's used doesn't match the chunks taken");
+        }
+    }
+
+    ngx_free(total);
+
+#undef ngx_slab_check_fail
+
+    return rc;
+}
+
+
+/**
+ * ngx_slab_check_page checks a page of chunks, and gives its slot, the 
+ * number of chunks it holds and how many of them are taken.
+ */
+static ngx_int_t ngx_slab_check_page(ngx_slab_pool_t *pool, ngx_slab_page_t *page, ngx_uint_t *slot, ngx_uint_t *chunks, ngx_uint_t *taken) {
+    uintptr_t   *bitmap, mask;
+    ngx_int_t    rc;
+    ngx_uint_t   i, n, map, shift, room;
+
+    rc = NGX_OK;
+    room = 0;
+    *taken = 0;
+    *chunks = 0;
+    *slot = pool->nslots;
+
+    switch (ngx_slab_page_type(page)) {
+
+    case NGX_SLAB_SMALL:
+        shift = page->slab & NGX_SLAB_SHIFT_MASK;
+
+        if (shift < pool->min_shift || shift >= ngx_slab_exact_shift) {
+            return NGX_ERROR;
+        }
+
+        bitmap = (uintptr_t *) ngx_slab_page_addr(pool, page);
+        map = (ngx_pagesize >> shift) / (8 * sizeof(uintptr_t));
+
+        /* chunks taken by the bitmap itself */
+
+        n = (ngx_pagesize >> shift) / ((1 << shift) * 8);
+
+        if (n == 0) {
+            n = 1;
+        }
+
+        for (i = 0; i < map; i++) {
+            *taken += ngx_slab_popcount(bitmap[i]);
+        }
+
+        *chunks = (ngx_pagesize >> shift) - n;
+        *taken -= n;
+        room = (*taken < *chunks);
+        *slot = shift - pool->min_shift;
+
+        break;
+
+    case NGX_SLAB_EXACT:
+        *chunks = 8 * sizeof(uintptr_t);
+        *taken = ngx_slab_popcount(page->slab);
+        room = (page->slab != NGX_SLAB_BUSY);
+        *slot = ngx_slab_exact_shift - pool->min_shift;
+
+        break;
+
+    case NGX_SLAB_BIG:
+        shift = page->slab & NGX_SLAB_SHIFT_MASK;
+
+        if (shift <= ngx_slab_exact_shift || shift >= ngx_pagesize_shift) {
+            return NGX_ERROR;
+        }
+
+        *chunks = ngx_pagesize >> shift;
+        mask = (((uintptr_t) 1 << *chunks) - 1) << NGX_SLAB_MAP_SHIFT;
+
+        if ((page->slab & NGX_SLAB_MAP_MASK) & ~mask) {
+            ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_check(): chunk beyond the page");
+            rc = NGX_ERROR;
+        }
+
+        *taken = ngx_slab_popcount(page->slab & NGX_SLAB_MAP_MASK);
+        room = (*taken < *chunks);
+        *slot = shift - pool->min_shift;
+
+        break;
+
+#if (NGX_SLAB_HAVE_FINE)
+    case NGX_SLAB_FINE:
+        *slot = pool->fine_slot + (page->slab >> NGX_SLAB_FINE_SHIFT);
+
+        if (*slot >= pool->nslots) {
+            return NGX_ERROR;
+        }
+
+        *chunks = ngx_pagesize / ngx_slab_slot_size(pool, *slot);
+        mask = ((uintptr_t) 1 << *chunks) - 1;
+
+        if ((page->slab & NGX_SLAB_FINE_MAP) & ~mask) {
+            ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_check(): chunk beyond the page");
+            rc = NGX_ERROR;
+        }
+
+        *taken = ngx_slab_popcount(page->slab & NGX_SLAB_FINE_MAP);
+        room = (*taken < *chunks);
+
+        break;
+#endif
+    }
+
+    if (*taken == 0) {
+        ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_check(): empty page of chunks not freed");
+        rc = NGX_ERROR;
+    }
+
+    if (room != (page->next != NULL)) {
+        ngx_slab_error(pool, NGX_LOG_ALERT, room ? "ngx_slab_check(): page with room off its slot"
+                                                 : "ngx_slab_check(): full page on its slot");
+        rc = NGX_ERROR;
+    }
+
+    return rc;
+}
+
+
+static ngx_inline ngx_uint_t ngx_slab_popcount(uintptr_t w) {
+#if (NGX_HAVE_BUILTIN_POPCOUNT)
+    return (ngx_uint_t) __builtin_popcountl((unsigned long) w);
+#else
+    ngx_uint_t  n;
+
+    for (n = 0; w; w &= w - 1, n++) { /* void */ }
+
+    return n;
+#endif
+}
+
+
+static void ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level, char *text) {
+    ngx_log_error(level, ngx_cycle->log, 0, "%s%s", text, pool->log_ctx);
+}
+
+
+/**
+ * ngx_slab_stats_json prints the zone's counters as a single JSON object 
+ * into [buf, last): free pages, the number of free runs they're split into 
+ * and the longest of them, and, per size class (slot), chunk size, 
+ * chunks carved out of pages, chunks in use, requests, failures and bytes 
+ * requested. "fragmentation" is the share (in percent) of the chunks handed 
+ * out which callers didn't ask for, to compare a zone with and without the 
+ * intermediate classes (`pool->fine`) under the same load. Meant to be 
+ * called with the zone's mutex held, so the counters are consistent with 
+ * each other. 
+ * 
+ * Returns the end of the printed text, output is truncated at `last`.
+ */
+u_char *ngx_slab_stats_json(ngx_slab_pool_t *pool, u_char *buf, u_char *last) {
+    size_t      size;
+    uint64_t    handed, requested;
+    ngx_uint_t  i;
+
+    handed = 0;
+    requested = 0;
+
+    for (i = 0; i < pool->nslots; i++) {
+        handed += (uint64_t) (pool->stats[i].reqs - pool->stats[i].fails) * ngx_slab_slot_size(pool, i);
+        requested += pool->stats[i].requested;
+    }
+
+    buf = ngx_slprintf(buf, last, "{\"pages\":%ui,\"free\":%ui,\"runs\":%ui,\"largest\":%ui,"
+                       "\"striped\":%ui,\"contended\":%ui,"
+                       "\"fine\":%ui,\"fragmentation\":%uL,\"slots\":[",
+                       (ngx_uint_t) (pool->last - pool->pages), pool->pfree,
+                       pool->pruns, ngx_slab_largest_run(pool),
+                       (ngx_uint_t) (pool->locks != NULL), pool->pcontended,
+                       (ngx_uint_t) (pool->fine_slot < pool->nslots),
+                       handed ? (handed - requested) * 100 / handed : (uint64_t) 0);
+
+    for (i = 0; i < pool->nslots; i++) {
+        size = ngx_slab_slot_size(pool, i);
+
+        buf = ngx_slprintf(buf, last, "%s{\"size\":%uz,\"total\":%ui,\"used\":%ui,\"reqs\":%ui,\"fails\":%ui,"
+                           "\"requested\":%ui,\"contended\":%ui}",
+                           i ? "," : "", size,
+                           pool->stats[i].total, pool->stats[i].used, 
+                           pool->stats[i].reqs, pool->stats[i].fails,
+                           pool->stats[i].requested, pool->stats[i].contended);
+    }
+
+    return ngx_slprintf(buf, last, "]}");
+}
@@ -21,10 +21,39 @@ typedef struct {
 
     ngx_uint_t        reqs;
     ngx_uint_t        fails;
+    ngx_uint_t        requested; /* bytes asked for by the successful requests, see `ngx_slab_stats_json()` */
+
+    ngx_uint_t        contended; /* acquisitions of the slot lock which had to wait, striped pools only */
 } ngx_slab_stat_t;
 
 
+/*
+ * A lock of a striped pool (see `ngx_slab_init_locks()`), the lock word
+ * and the mutex both live in the shared zone, like `pool->mutex` does.
+ */
 typedef struct {
+    ngx_shmtx_sh_t    sh;
+    ngx_shmtx_t       mutex;
+} ngx_slab_lock_t;
+
+
+typedef struct ngx_slab_magazines_s  ngx_slab_magazines_t;
+typedef struct ngx_slab_pool_s       ngx_slab_pool_t;
+
+/* reclaims about `pages` pages, returns how many it did, see `ngx_slab_evict()` */
+typedef ngx_uint_t (*ngx_slab_evict_pt)(ngx_slab_pool_t *pool, ngx_uint_t pages, void *data);
+
+
+/*
+ * Free page runs of up to NGX_SLAB_RUNS_EXACT pages are kept in a list per
+ * length, longer ones in a list per power of two, see `ngx_slab_alloc_pages()`.
+ */
+#define NGX_SLAB_RUNS_EXACT_SHIFT  5
+#define NGX_SLAB_RUNS_EXACT        (1 << NGX_SLAB_RUNS_EXACT_SHIFT)
+#define NGX_SLAB_BINS              64
+
+
+struct ngx_slab_pool_s {
     ngx_shmtx_sh_t    lock;
 
     size_t            min_size;  /* 8 bytes, used only by `ngx_init_zone_pool` */
@@ -32,24 +61,97 @@ typedef struct {
 
     ngx_slab_page_t  *pages;
     ngx_slab_page_t  *last;
-    ngx_slab_page_t   free;
+    ngx_slab_page_t   free[NGX_SLAB_BINS]; /* free page runs by length, see `ngx_slab_alloc_pages()` */
+    uint64_t          binmap;    /* a bit per non-empty bin */
+    ngx_uint_t        pruns;     /* free page runs, `pfree` split into that many pieces */
 
     ngx_slab_stat_t  *stats;
     ngx_uint_t        pfree;
+    ngx_uint_t        nslots;
+    ngx_uint_t        fine_slot; /* first slot of the intermediate size classes, `nslots` if there are none */
+
+    ngx_slab_lock_t  *locks;     /* per-slot locks followed by the free pages lock, NULL unless striped */
+    ngx_uint_t        pcontended; /* acquisitions of the free pages lock which had to wait */
+
+    ngx_atomic_t     *rfree;     /* per slot stacks of remotely freed chunks, NULL unless `remote` */
+    ngx_pid_t        *owners;    /* per page, the process which took it for a slot */
 
     u_char           *start;
     u_char           *end;
+    u_char           *limit;     /* the end the zone may grow up to, see `ngx_slab_resize()` */
 
-    ngx_shm_t         mutex;
+    ngx_shmtx_t       mutex;
 
     u_char           *log_ctx;
     u_char            zero;
 
     unsigned          log_nomem:1;
+    unsigned          striped:1; /* set before `ngx_slab_init()` to get a lock per slot */
+    unsigned          fine:1;    /* set before `ngx_slab_init()` to get intermediate size classes, 64-bit only */
+    unsigned          magazines:1; /* set before fork() to cache free chunks per process */
+    unsigned          local:1;   /* a private pool, see `ngx_slab_create_private()` */
+    unsigned          remote:1;  /* set before `ngx_slab_init()` to defer frees of other processes' chunks */
+
+    ngx_uint_t        low;       /* free pages below which the eviction handler is called */
+    ngx_uint_t        high;      /* free pages the handler is asked to get back up to */
+    ngx_slab_evict_pt evict;     /* set by the zone's owner along with `evict_data`, NULL if none */
+    void             *evict_data;
+    ngx_atomic_t      evicting;  /* pid of the process running the handler */
 
     void             *data;
     void             *addr;
-} ngx_slab_pool_t;
+};
+
+
+/* `shm->layout` of slab zones, a file-backed zone of another layout isn't reattached */
+#define NGX_SLAB_LAYOUT                                                       \
+    ((sizeof(ngx_slab_pool_t) << 16) | (sizeof(ngx_slab_page_t) << 8)        \
+     | ngx_pagesize_shift)
+
+
+#define NGX_SLAB_MAGAZINE_SIZE  32
+
+
+/*
+ * A process' stack of free chunks of a slot, along with the stats deltas of
+ * what was served from it, which are folded into the zone's stats under the lock.
+ */
+typedef struct {
+    ngx_uint_t        n;
+    ngx_int_t         reqs;
+    ngx_int_t         used;
+    ngx_uint_t        requested;
+    void             *chunks[NGX_SLAB_MAGAZINE_SIZE];
+} ngx_slab_magazine_t;
+
+
+/* magazines of a zone in the calling process, lives in process-local memory */
+struct ngx_slab_magazines_s {
+    ngx_slab_pool_t       *pool;
+    ngx_pid_t              pid;     /* the process which filled them, reset after fork() */
+    ngx_slab_magazine_t   *slots;
+    ngx_slab_magazines_t  *next;
+};
+
+
+void ngx_slab_sizes_init(void);
+void ngx_slab_init(ngx_slab_pool_t *pool);
+void ngx_slab_reattach(ngx_slab_pool_t *pool);
+void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size);
+void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
+void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+ngx_int_t ngx_slab_alloc_n(ngx_slab_pool_t *pool, size_t *sizes, void **ptrs, ngx_uint_t n);
+void ngx_slab_free_n(ngx_slab_pool_t *pool, void **ptrs, ngx_uint_t n);
+ngx_slab_pool_t *ngx_slab_create_private(size_t size, ngx_log_t *log);
+void ngx_slab_destroy_private(ngx_slab_pool_t *pool);
+ngx_int_t ngx_slab_resize(ngx_slab_pool_t *pool, u_char *end);
+void ngx_slab_magazines_flush(void);
+ngx_uint_t ngx_slab_force_unlock(ngx_slab_pool_t *pool, ngx_pid_t pid);
+ngx_int_t ngx_slab_check(ngx_slab_pool_t *pool);
+u_char *ngx_slab_stats_json(ngx_slab_pool_t *pool, u_char *buf, u_char *last);
 
 
 #endif /* _NGX_SLAB_H_INCLUDED_ */
\ No newline at end of file
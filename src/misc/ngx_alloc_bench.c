@@ -0,0 +1,700 @@
+
+/**
+ * A standalone microbenchmark of the pool and slab allocators, each run
+ * against malloc(3) under the same load. Prints a single JSON object to
+ * stdout, so runs before and after an allocator change can be diffed or
+ * fed to a plotting script:
+ *   - "pool": `ngx_palloc()`, `ngx_pnalloc()` and `ngx_pcalloc()` over a few
+ *     size distributions. Every round creates a pool, makes `NGX_BENCH_ALLOCS`
+ *     allocations out of it and destroys it; the baseline mallocs (callocs
+ *     for `ngx_pcalloc()`) the same sizes and frees them one by one;
+ *   - "churn": creating a pool, one small allocation and destroying it, with
+ *     the block cache off, on, and in arena mode, against malloc()/free()
+ *     of a block;
+ *   - "conns": connection churn, `NGX_BENCH_CONNS` pools live at once, each
+ *     with a handful of allocations read on every pass, as the buffers and
+ *     structures of a connection are; a random one is destroyed and created
+ *     anew. With arenas off and on, along with dTLB load misses per pass
+ *     counted with perf_event_open(2), -1 where the counter is unavailable
+ *     (no PMU in a VM, kernel.perf_event_paranoid);
+ *   - "slab": `ngx_slab_alloc_locked()`/`ngx_slab_free_locked()` and their
+ *     locking variants per size class of a shared zone, requests spread over
+ *     the upper half of each class, against malloc()/free() of the same sizes.
+ *
+ * Times are ns per operation (an allocation along with its share of the
+ * release), "alloc" and "free" split them. "overhead" is bytes per allocation
+ * taken beyond the requested ones: pool blocks and large allocations with
+ * their nodes for pools, pages taken out of the zone for slab,
+ * malloc_usable_size() plus the chunk header for malloc().
+ *
+ * There's no build manifest in the tree, the benchmark is built right next
+ * to the allocator sources (the headers define a few globals, hence
+ * -fcommon), the optional argument scales the number of rounds:
+ *
+ *   cc -O2 -fcommon -Isrc/core -Isrc/os/unix -Iobjs -o ngx_alloc_bench \
+ *       src/misc/ngx_alloc_bench.c src/core/ngx_palloc.c src/core/ngx_slab.c \
+ *       src/core/ngx_shmtx.c src/core/ngx_string.c \
+ *       src/os/unix/ngx_alloc.c src/os/unix/ngx_shmem.c
+ *
+ *   ./ngx_alloc_bench [rounds]
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <malloc.h> /* malloc_usable_size() */
+
+#if (NGX_LINUX)
+#include <linux/perf_event.h>
+#endif
+
+
+#define NGX_BENCH_ROUNDS      500
+#define NGX_BENCH_ALLOCS      1024
+#define NGX_BENCH_CHURN       16            /* churn iterations per round */
+#define NGX_BENCH_CONNS       512           /* pools live at once in "conns" */
+#define NGX_BENCH_CONN_ALLOCS 8             /* allocations of a connection */
+#define NGX_BENCH_ZONE_SIZE   (64 * 1024 * 1024)
+#define NGX_BENCH_OUTPUT      (64 * 1024)
+
+
+typedef void *(*ngx_bench_palloc_pt)(ngx_pool_t *pool, size_t size);
+typedef void *(*ngx_bench_malloc_pt)(size_t size);
+
+
+typedef struct {
+    char                 *name;
+    size_t                min;
+    size_t                max;
+    size_t                big_min;      /* every `big_every`th size is drawn from [big_min, big_max] */
+    size_t                big_max;
+    ngx_uint_t            big_every;
+} ngx_bench_dist_t;
+
+
+typedef struct {
+    double                alloc;        /* ns per allocation */
+    double                free;         /* ns per allocation spent releasing it */
+    double                overhead;     /* bytes per allocation beyond the requested ones */
+} ngx_bench_result_t;
+
+
+typedef struct {
+    ngx_pool_t           *pool;
+    u_char               *allocs[NGX_BENCH_CONN_ALLOCS];
+} ngx_bench_conn_t;
+
+
+typedef struct {
+    double                ns;           /* per pass */
+    double                dtlb;         /* dTLB load misses per pass, -1 if not counted */
+} ngx_bench_conns_t;
+
+
+static uint64_t ngx_bench_now(void);
+static uint64_t ngx_bench_random(void);
+static void ngx_bench_sizes(ngx_bench_dist_t *dist, size_t *sizes, size_t *total);
+static size_t ngx_bench_pool_footprint(ngx_pool_t *pool);
+static void ngx_bench_pool(ngx_bench_palloc_pt palloc, size_t *sizes, size_t total, ngx_uint_t rounds, ngx_bench_result_t *r);
+static void ngx_bench_malloc(ngx_bench_malloc_pt alloc, size_t *sizes, ngx_uint_t n, ngx_uint_t rounds, ngx_bench_result_t *r);
+static void *ngx_bench_calloc(size_t size);
+static double ngx_bench_churn(ngx_uint_t n);
+static double ngx_bench_churn_malloc(ngx_uint_t n);
+static void ngx_bench_conns(ngx_uint_t n, ngx_bench_conns_t *r);
+static void ngx_bench_conn_open(ngx_bench_conn_t *c);
+static int ngx_bench_dtlb_open(void);
+static int64_t ngx_bench_dtlb_read(int fd);
+static void ngx_bench_slab(ngx_slab_pool_t *pool, ngx_uint_t locked, size_t *sizes, ngx_uint_t n, ngx_uint_t rounds, ngx_bench_result_t *r);
+static u_char *ngx_bench_print(u_char *p, u_char *last, char *sep, char *name, ngx_bench_result_t *r);
+
+
+/* what the allocators need from the rest of nginx */
+ngx_pid_t           ngx_pid;
+ngx_int_t           ngx_ncpu;
+volatile ngx_str_t  ngx_cached_err_log_time;
+
+static ngx_log_t    ngx_bench_log;
+static ngx_cycle_t  ngx_bench_cycle;
+
+static uint64_t     ngx_bench_seed = 0x9e3779b97f4a7c15;
+
+static void        *ngx_bench_ptrs[NGX_BENCH_ALLOCS];
+
+
+static ngx_bench_dist_t  ngx_bench_dists[] = {
+    { "tiny",  8, 64, 0, 0, 0 },
+    { "small", 16, 512, 0, 0, 0 },          /* headers, strings, small structs */
+    { "mixed", 16, 512, 1024, 8192, 10 },   /* every 10th one a buffer, some of them large */
+    { "large", 4096, 32768, 0, 0, 0 },      /* all above `pool->max` */
+    { NULL, 0, 0, 0, 0, 0 }
+};
+
+
+void ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...) {
+    u_char   errstr[NGX_MAX_ERROR_STR], *p, *last;
+    va_list  args;
+
+    last = errstr + NGX_MAX_ERROR_STR - 1;
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(errstr, last, fmt, args);
+    va_end(args);
+
+    if (err) {
+        p = ngx_slprintf(p, last, " (%d: %s)", err, strerror(err));
+    }
+
+    *p++ = LF;
+
+    (void) write(STDERR_FILENO, errstr, p - errstr);
+}
+
+
+int ngx_cdecl main(int argc, char *const *argv) {
+    u_char              *out, *p, *last;
+    size_t              *sizes, total, size;
+    ngx_int_t            n;
+    ngx_uint_t           i, rounds, churn, nslab, max;
+    ngx_shm_t            shm;
+    ngx_slab_pool_t     *pool;
+    ngx_bench_dist_t    *dist;
+    ngx_bench_result_t   r;
+    ngx_bench_conns_t    heap, arena;
+
+    rounds = NGX_BENCH_ROUNDS;
+
+    if (argc > 1) {
+        n = atoi(argv[1]);
+        if (n <= 0) {
+            ngx_log_error(NGX_LOG_EMERG, &ngx_bench_log, 0, "invalid number of rounds \"%s\"", argv[1]);
+            return 1;
+        }
+
+        rounds = n;
+    }
+
+    ngx_bench_log.log_level = NGX_LOG_WARN;
+    ngx_bench_cycle.log = &ngx_bench_log;
+    ngx_cycle = &ngx_bench_cycle;
+
+    ngx_pid = getpid();
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    for (i = ngx_pagesize; i >>= 1; ngx_pagesize_shift++) { /* void */ }
+
+    out = ngx_alloc(NGX_BENCH_OUTPUT, &ngx_bench_log);
+    sizes = ngx_alloc(NGX_BENCH_ALLOCS * sizeof(size_t), &ngx_bench_log);
+    if (out == NULL || sizes == NULL) {
+        return 1;
+    }
+
+    p = out;
+    last = out + NGX_BENCH_OUTPUT;
+
+    p = ngx_slprintf(p, last, "{\"rounds\":%ui,\"allocs\":%ui,\"pool\":{", rounds, (ngx_uint_t) NGX_BENCH_ALLOCS);
+
+    for (dist = ngx_bench_dists; dist->name; dist++) {
+        ngx_bench_sizes(dist, sizes, &total);
+
+        p = ngx_slprintf(p, last, "%s\"%s\":{\"requested\":%uz,", dist == ngx_bench_dists ? "" : ",", dist->name, total);
+
+        ngx_bench_pool(ngx_palloc, sizes, total, rounds, &r);
+        p = ngx_bench_print(p, last, "", "palloc", &r);
+
+        ngx_bench_pool(ngx_pnalloc, sizes, total, rounds, &r);
+        p = ngx_bench_print(p, last, ",", "pnalloc", &r);
+
+        ngx_bench_pool(ngx_pcalloc, sizes, total, rounds, &r);
+        p = ngx_bench_print(p, last, ",", "pcalloc", &r);
+
+        ngx_bench_malloc(malloc, sizes, NGX_BENCH_ALLOCS, rounds, &r);
+        p = ngx_bench_print(p, last, ",", "malloc", &r);
+
+        ngx_bench_malloc(ngx_bench_calloc, sizes, NGX_BENCH_ALLOCS, rounds, &r);
+        p = ngx_bench_print(p, last, ",", "calloc", &r);
+
+        p = ngx_slprintf(p, last, "}");
+    }
+
+    churn = rounds * NGX_BENCH_CHURN;
+
+    p = ngx_slprintf(p, last, "},\"churn\":{\"pools\":%ui", churn);
+
+    ngx_pool_cache_init(NGX_DEFAULT_POOL_SIZE, 0, 0);
+    p = ngx_slprintf(p, last, ",\"nocache\":%.2f", ngx_bench_churn(churn));
+
+    ngx_pool_cache_init(NGX_DEFAULT_POOL_SIZE, NGX_POOL_CACHE_LOW, NGX_POOL_CACHE_HIGH);
+    p = ngx_slprintf(p, last, ",\"cache\":%.2f", ngx_bench_churn(churn));
+
+    /* arena mode stays on once set, the connections with arenas off go first */
+
+    ngx_bench_conns(churn, &heap);
+
+    arena.ns = -1;
+
+    if (ngx_pool_arena_init(&ngx_bench_log) == NGX_OK) {
+        p = ngx_slprintf(p, last, ",\"arena\":%.2f", ngx_bench_churn(churn));
+
+        ngx_bench_conns(churn, &arena);
+    }
+
+    p = ngx_slprintf(p, last, ",\"malloc\":%.2f}", ngx_bench_churn_malloc(churn));
+
+    p = ngx_slprintf(p, last, ",\"conns\":{\"live\":%ui,\"passes\":%ui,"
+                     "\"heap\":{\"ns\":%.2f,\"dtlb\":%.2f}",
+                     (ngx_uint_t) NGX_BENCH_CONNS, churn, heap.ns, heap.dtlb);
+
+    if (arena.ns >= 0) {
+        p = ngx_slprintf(p, last, ",\"arena\":{\"ns\":%.2f,\"dtlb\":%.2f}", arena.ns, arena.dtlb);
+    }
+
+    p = ngx_slprintf(p, last, "}");
+
+    /* a zone set up the way `ngx_init_zone_pool()` does it */
+
+    ngx_memzero(&shm, sizeof(ngx_shm_t));
+
+    shm.size = NGX_BENCH_ZONE_SIZE;
+    shm.name.len = sizeof("bench") - 1;
+    shm.name.data = (u_char *) "bench";
+    shm.log = &ngx_bench_log;
+
+    if (ngx_shm_alloc(&shm) != NGX_OK) {
+        return 1;
+    }
+
+    pool = (ngx_slab_pool_t *) shm.addr;
+    pool->end = shm.addr + shm.size;
+    pool->min_shift = 3;
+    pool->addr = shm.addr;
+
+    if (ngx_shmtx_create(&pool->mutex, &pool->lock, NULL) != NGX_OK) {
+        return 1;
+    }
+
+    ngx_slab_sizes_init();
+    ngx_slab_init(pool);
+
+    p = ngx_slprintf(p, last, ",\"slab\":[");
+
+    max = ngx_pagesize / 2;
+
+    for (size = 8; size <= max; size <<= 1) {
+        for (i = 0; i < NGX_BENCH_ALLOCS; i++) {
+            sizes[i] = size > 8 ? size / 2 + 1 + ngx_bench_random() % (size / 2) : size;
+        }
+
+        /* keep a round well within the zone, several chunks are spread over a page */
+        nslab = ngx_min(NGX_BENCH_ALLOCS, (NGX_BENCH_ZONE_SIZE / 2) / ngx_max(size, ngx_pagesize / 8));
+
+        p = ngx_slprintf(p, last, "%s{\"size\":%uz,", size == 8 ? "" : ",", size);
+
+        ngx_bench_slab(pool, 1, sizes, nslab, rounds, &r);
+        p = ngx_bench_print(p, last, "", "locked", &r);
+
+        ngx_bench_slab(pool, 0, sizes, nslab, rounds, &r);
+        p = ngx_bench_print(p, last, ",", "mutex", &r);
+
+        ngx_bench_malloc(malloc, sizes, nslab, rounds, &r);
+        p = ngx_bench_print(p, last, ",", "malloc", &r);
+
+        p = ngx_slprintf(p, last, "}");
+    }
+
+    p = ngx_slprintf(p, last, "]}%N");
+
+    (void) write(STDOUT_FILENO, out, p - out);
+
+    ngx_shm_free(&shm);
+
+    return 0;
+}
+
+
+static uint64_t ngx_bench_now(void) {
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* xorshift64*, the same sequence on every run */
+static uint64_t ngx_bench_random(void) {
+    ngx_bench_seed ^= ngx_bench_seed >> 12;
+    ngx_bench_seed ^= ngx_bench_seed << 25;
+    ngx_bench_seed ^= ngx_bench_seed >> 27;
+
+    return ngx_bench_seed * 0x2545f4914f6cdd1d;
+}
+
+
+static void ngx_bench_sizes(ngx_bench_dist_t *dist, size_t *sizes, size_t *total) {
+    ngx_uint_t  i;
+
+    *total = 0;
+
+    for (i = 0; i < NGX_BENCH_ALLOCS; i++) {
+        if (dist->big_every && i % dist->big_every == dist->big_every - 1) {
+            sizes[i] = dist->big_min + ngx_bench_random() % (dist->big_max - dist->big_min + 1);
+
+        } else {
+            sizes[i] = dist->min + ngx_bench_random() % (dist->max - dist->min + 1);
+        }
+
+        *total += sizes[i];
+    }
+}
+
+
+/* bytes a pool holds: its blocks, headers included, and live large allocations with their nodes */
+static size_t ngx_bench_pool_footprint(ngx_pool_t *pool) {
+    size_t             size;
+    ngx_pool_t        *p;
+    ngx_pool_large_t  *l;
+
+    size = 0;
+
+    for (p = pool; p; p = p->d.next) {
+        size += p->d.end - (u_char *) p;
+    }
+
+    for (l = pool->large; l; l = l->next) {
+        size += (u_char *) l->alloc + l->size - (u_char *) l->start;
+    }
+
+    return size;
+}
+
+
+static void ngx_bench_pool(ngx_bench_palloc_pt palloc, size_t *sizes, size_t total, ngx_uint_t rounds, ngx_bench_result_t *r) {
+    u_char      *p;
+    uint64_t     start, alloc, free;
+    ngx_uint_t   i, n;
+    ngx_pool_t  *pool;
+
+    alloc = 0;
+    free = 0;
+
+    for (n = 0; n < rounds; n++) {
+        start = ngx_bench_now();
+
+        pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &ngx_bench_log);
+        if (pool == NULL) {
+            exit(1);
+        }
+
+        for (i = 0; i < NGX_BENCH_ALLOCS; i++) {
+            p = palloc(pool, sizes[i]);
+            if (p == NULL) {
+                exit(1);
+            }
+
+            *p = (u_char) i;
+        }
+
+        alloc += ngx_bench_now() - start;
+
+        if (n == 0) {
+            r->overhead = (double) (ngx_bench_pool_footprint(pool) - total) / NGX_BENCH_ALLOCS;
+        }
+
+        start = ngx_bench_now();
+
+        ngx_destroy_pool(pool);
+
+        free += ngx_bench_now() - start;
+    }
+
+    r->alloc = (double) alloc / rounds / NGX_BENCH_ALLOCS;
+    r->free = (double) free / rounds / NGX_BENCH_ALLOCS;
+}
+
+
+static void ngx_bench_malloc(ngx_bench_malloc_pt alloc, size_t *sizes, ngx_uint_t n, ngx_uint_t rounds, ngx_bench_result_t *r) {
+    u_char      *p;
+    uint64_t     start, nalloc, nfree;
+    ngx_uint_t   i, k;
+
+    nalloc = 0;
+    nfree = 0;
+    r->overhead = 0;
+
+    for (k = 0; k < rounds; k++) {
+        start = ngx_bench_now();
+
+        for (i = 0; i < n; i++) {
+            p = alloc(sizes[i]);
+            if (p == NULL) {
+                exit(1);
+            }
+
+            *p = (u_char) i;
+            ngx_bench_ptrs[i] = p;
+        }
+
+        nalloc += ngx_bench_now() - start;
+
+        if (k == 0) {
+            for (i = 0; i < n; i++) {
+                r->overhead += (double) (malloc_usable_size(ngx_bench_ptrs[i]) + sizeof(size_t) - sizes[i]) / n;
+            }
+        }
+
+        start = ngx_bench_now();
+
+        for (i = 0; i < n; i++) {
+            free(ngx_bench_ptrs[i]);
+        }
+
+        nfree += ngx_bench_now() - start;
+    }
+
+    r->alloc = (double) nalloc / rounds / n;
+    r->free = (double) nfree / rounds / n;
+}
+
+
+static void *ngx_bench_calloc(size_t size) {
+    return calloc(1, size);
+}
+
+
+/* ns per pool created, allocated from once and destroyed */
+static double ngx_bench_churn(ngx_uint_t n) {
+    u_char      *p;
+    uint64_t     start;
+    ngx_uint_t   i;
+    ngx_pool_t  *pool;
+
+    start = ngx_bench_now();
+
+    for (i = 0; i < n; i++) {
+        pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &ngx_bench_log);
+        if (pool == NULL) {
+            exit(1);
+        }
+
+        p = ngx_palloc(pool, 128);
+        *p = (u_char) i;
+
+        ngx_destroy_pool(pool);
+    }
+
+    return (double) (ngx_bench_now() - start) / n;
+}
+
+
+static double ngx_bench_churn_malloc(ngx_uint_t n) {
+    u_char      *p;
+    uint64_t     start;
+    ngx_uint_t   i;
+
+    start = ngx_bench_now();
+
+    for (i = 0; i < n; i++) {
+        p = malloc(NGX_DEFAULT_POOL_SIZE);
+        if (p == NULL) {
+            exit(1);
+        }
+
+        p[sizeof(ngx_pool_t)] = (u_char) i;
+
+        free(p);
+    }
+
+    return (double) (ngx_bench_now() - start) / n;
+}
+
+
+/**
+ * Connection churn: every pass reads the allocations of a random live 
+ * connection, then closes it and opens another one in its place. Blocks 
+ * of the live pools are scattered over the heap, or packed into the 
+ * huge-page arenas, hence the dTLB misses.
+ */
+static void ngx_bench_conns(ngx_uint_t n, ngx_bench_conns_t *r) {
+    int                fd;
+    u_char            *p;
+    int64_t            misses;
+    uint64_t           start;
+    ngx_uint_t         i, k, sum;
+    ngx_bench_conn_t  *conns, *c;
+
+    conns = ngx_alloc(NGX_BENCH_CONNS * sizeof(ngx_bench_conn_t), &ngx_bench_log);
+    if (conns == NULL) {
+        exit(1);
+    }
+
+    for (i = 0; i < NGX_BENCH_CONNS; i++) {
+        ngx_bench_conn_open(&conns[i]);
+    }
+
+    fd = ngx_bench_dtlb_open();
+    sum = 0;
+
+    start = ngx_bench_now();
+
+    for (i = 0; i < n; i++) {
+        c = &conns[ngx_bench_random() % NGX_BENCH_CONNS];
+
+        for (k = 0; k < NGX_BENCH_CONN_ALLOCS; k++) {
+            p = c->allocs[k];
+            sum += p[0] + p[64];
+        }
+
+        ngx_destroy_pool(c->pool);
+        ngx_bench_conn_open(c);
+    }
+
+    r->ns = (double) (ngx_bench_now() - start) / n;
+
+    misses = ngx_bench_dtlb_read(fd);
+    r->dtlb = misses < 0 ? -1 : (double) misses / n;
+
+    for (i = 0; i < NGX_BENCH_CONNS; i++) {
+        ngx_destroy_pool(conns[i].pool);
+    }
+
+    ngx_free(conns);
+
+    /* keeps the reads */
+    if (sum == (ngx_uint_t) -1) {
+        ngx_log_error(NGX_LOG_WARN, &ngx_bench_log, 0, "sum %ui", sum);
+    }
+}
+
+
+/* a pool with the structures and buffers of a connection, 128 bytes up to 2K each */
+static void ngx_bench_conn_open(ngx_bench_conn_t *c) {
+    size_t      size;
+    ngx_uint_t  k;
+
+    c->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &ngx_bench_log);
+    if (c->pool == NULL) {
+        exit(1);
+    }
+
+    for (k = 0; k < NGX_BENCH_CONN_ALLOCS; k++) {
+        size = 128 << (ngx_bench_random() % 5);
+
+        c->allocs[k] = ngx_palloc(c->pool, size);
+        if (c->allocs[k] == NULL) {
+            exit(1);
+        }
+
+        ngx_memset(c->allocs[k], (int) k, size);
+    }
+}
+
+
+/* dTLB load misses of this process in user space, counting from now on, -1 if unavailable */
+static int ngx_bench_dtlb_open(void) {
+#if (NGX_LINUX)
+    int                     fd;
+    struct perf_event_attr  attr;
+
+    ngx_memzero(&attr, sizeof(struct perf_event_attr));
+
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(struct perf_event_attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+                  | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_WARN, &ngx_bench_log, ngx_errno, "perf_event_open(DTLB) failed, misses aren't counted");
+    }
+
+    return fd;
+
+#else
+
+    return -1;
+
+#endif
+}
+
+
+static int64_t ngx_bench_dtlb_read(int fd) {
+    int64_t  misses;
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (read(fd, &misses, sizeof(int64_t)) != sizeof(int64_t)) {
+        misses = -1;
+    }
+
+    close(fd);
+
+    return misses;
+}
+
+
+static void ngx_bench_slab(ngx_slab_pool_t *pool, ngx_uint_t locked, size_t *sizes, ngx_uint_t n, ngx_uint_t rounds, ngx_bench_result_t *r) {
+    u_char      *p;
+    uint64_t     start, alloc, free;
+    ngx_uint_t   i, k, pfree;
+
+    alloc = 0;
+    free = 0;
+
+    for (k = 0; k < rounds; k++) {
+        pfree = pool->pfree;
+
+        start = ngx_bench_now();
+
+        for (i = 0; i < n; i++) {
+            p = locked ? ngx_slab_alloc_locked(pool, sizes[i]) : ngx_slab_alloc(pool, sizes[i]);
+            if (p == NULL) {
+                exit(1);
+            }
+
+            *p = (u_char) i;
+            ngx_bench_ptrs[i] = p;
+        }
+
+        alloc += ngx_bench_now() - start;
+
+        if (k == 0) {
+            r->overhead = 0;
+
+            for (i = 0; i < n; i++) {
+                r->overhead -= (double) sizes[i] / n;
+            }
+
+            r->overhead += (double) ((pfree - pool->pfree) << ngx_pagesize_shift) / n;
+        }
+
+        start = ngx_bench_now();
+
+        for (i = 0; i < n; i++) {
+            if (locked) {
+                ngx_slab_free_locked(pool, ngx_bench_ptrs[i]);
+
+            } else {
+                ngx_slab_free(pool, ngx_bench_ptrs[i]);
+            }
+        }
+
+        free += ngx_bench_now() - start;
+    }
+
+    r->alloc = (double) alloc / rounds / n;
+    r->free = (double) free / rounds / n;
+}
+
+
+static u_char *ngx_bench_print(u_char *p, u_char *last, char *sep, char *name, ngx_bench_result_t *r) {
+    return ngx_slprintf(p, last, "%s\"%s\":{\"ns\":%.2f,\"alloc\":%.2f,\"free\":%.2f,\"overhead\":%.2f}",
+                        sep, name, r->alloc + r->free, r->alloc, r->free, r->overhead);
+}
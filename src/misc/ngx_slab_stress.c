@@ -0,0 +1,664 @@
+
+/**
+ * A multi-process stress driver of a shared slab zone. The zone is set up
+ * the way `ngx_init_zone_pool()` does it, then the workers are forked and
+ * run through phases of random allocations and frees, each phase with its
+ * own mix of sizes and share of allocations (see `ngx_stress_phases`):
+ *   - every chunk carries its size and a tag, which are checked when it's
+ *     freed, so a chunk handed out twice or overwritten shows up;
+ *   - some freed chunks are passed through a shared exchange instead, and
+ *     freed by whichever worker picks them up, as with a cache entry freed
+ *     by another worker than the one which created it;
+ *   - between phases the workers wait at a barrier, and the zone, quiescent,
+ *     is walked with `ngx_slab_check()`;
+ *   - at the end the workers free everything they hold and flush their
+ *     magazines; remote frees left on the stacks are drained, and every page
+ *     has to be free again.
+ *
+ * Prints a JSON object to stdout: per phase the wall time, operations and
+ * their rate over all the workers, failed allocations, the check's verdict
+ * and free pages left; per size class allocations, frees, failures, average
+ * ns per call and millions of calls per second of a worker; then the zone's
+ * own counters as `ngx_slab_stats_json()` has them at the end of the run,
+ * "fragmentation" included, to compare runs with and without -f. Exits with
+ * 1 if a check failed, a chunk was corrupted, pages leaked or a worker died.
+ *
+ *   -w N   workers (4)
+ *   -p N   phases (8), the phase mixes are cycled through
+ *   -n N   operations per worker and phase (200000)
+ *   -z N   zone size in MB (64)
+ *   -s     striped locks, -f intermediate size classes, -m magazines,
+ *   -r     remote frees, see `ngx_slab_pool_t`
+ *
+ * It's built the same way as src/misc/ngx_alloc_bench.c:
+ *
+ *   cc -O2 -fcommon -Isrc/core -Isrc/os/unix -Iobjs -o ngx_slab_stress \
+ *       src/misc/ngx_slab_stress.c src/core/ngx_palloc.c src/core/ngx_slab.c \
+ *       src/core/ngx_shmtx.c src/core/ngx_string.c \
+ *       src/os/unix/ngx_alloc.c src/os/unix/ngx_shmem.c
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_STRESS_LIVE       8192          /* chunks a worker holds at most */
+#define NGX_STRESS_EXCHANGE   4096
+#define NGX_STRESS_CLASSES    16            /* 8 bytes up to half a page, then whole pages */
+#define NGX_STRESS_OUTPUT     (64 * 1024)
+
+
+typedef struct {
+    char                 *name;
+    ngx_uint_t            min_shift;
+    ngx_uint_t            max_shift;    /* sizes up to (1 << max_shift), past half a page take whole pages */
+    ngx_uint_t            allocs;       /* percent of operations which allocate */
+} ngx_stress_phase_t;
+
+
+/* the start of every chunk handed out */
+typedef struct {
+    uint32_t              size;
+    uint32_t              tag;          /* its low byte is repeated in the last byte of the chunk */
+} ngx_stress_chunk_t;
+
+
+typedef struct {
+    uint64_t              allocs;
+    uint64_t              frees;
+    uint64_t              fails;
+    uint64_t              alloc_ns;
+    uint64_t              free_ns;
+} ngx_stress_class_t;
+
+
+typedef struct {
+    ngx_stress_class_t    classes[NGX_STRESS_CLASSES];
+    uint64_t              exchanged;    /* chunks freed by this worker which another one allocated */
+    uint64_t              corrupted;
+} ngx_stress_worker_t;
+
+
+/* lives in a zone of its own, next to the one stressed */
+typedef struct {
+    ngx_atomic_t          phase;        /* set by the master to start a phase, past the last one to exit */
+    ngx_atomic_t          done;         /* workers which finished the phase */
+    ngx_atomic_t          exchange[NGX_STRESS_EXCHANGE];
+    ngx_stress_worker_t   workers[1];
+} ngx_stress_ctl_t;
+
+
+static void ngx_stress_worker(ngx_slab_pool_t *pool, ngx_stress_ctl_t *ctl, ngx_uint_t w, ngx_uint_t nphases, ngx_uint_t ops);
+static void ngx_stress_alloc(ngx_slab_pool_t *pool, ngx_stress_worker_t *wk, ngx_stress_phase_t *ph, ngx_stress_chunk_t **live, ngx_uint_t *nlive);
+static void ngx_stress_free(ngx_slab_pool_t *pool, ngx_stress_worker_t *wk, ngx_stress_chunk_t *c);
+static ngx_uint_t ngx_stress_class(size_t size);
+static ngx_int_t ngx_stress_wait(ngx_stress_ctl_t *ctl, ngx_uint_t nworkers);
+static void ngx_stress_sum(ngx_stress_ctl_t *ctl, ngx_uint_t nworkers, ngx_stress_class_t *sum);
+static uint64_t ngx_stress_now(void);
+static uint64_t ngx_stress_random(void);
+
+
+/* what the allocators need from the rest of nginx */
+ngx_pid_t           ngx_pid;
+ngx_int_t           ngx_ncpu;
+volatile ngx_str_t  ngx_cached_err_log_time;
+
+static ngx_log_t    ngx_stress_log;
+static ngx_cycle_t  ngx_stress_cycle;
+
+static uint64_t     ngx_stress_seed;
+
+
+static ngx_stress_phase_t  ngx_stress_phases[] = {
+    { "fill",  3, 8, 70 },                  /* small chunks piling up */
+    { "churn", 3, 11, 50 },                 /* all the chunk classes */
+    { "pages", 3, 14, 50 },                 /* whole page runs mixed in, fragmenting the free pages */
+    { "drain", 3, 11, 30 },
+    { NULL, 0, 0, 0 }
+};
+
+
+void ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...) {
+    u_char   errstr[NGX_MAX_ERROR_STR], *p, *last;
+    va_list  args;
+
+    last = errstr + NGX_MAX_ERROR_STR - 1;
+
+    p = ngx_slprintf(errstr, last, "[%P] ", ngx_pid);
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(p, last, fmt, args);
+    va_end(args);
+
+    if (err) {
+        p = ngx_slprintf(p, last, " (%d: %s)", err, strerror(err));
+    }
+
+    *p++ = LF;
+
+    (void) write(STDERR_FILENO, errstr, p - errstr);
+}
+
+
+int ngx_cdecl main(int argc, char *const *argv) {
+    int                  c;
+    void                *chunk;
+    u_char              *out, *p, *last;
+    uint64_t             start, ms, nops, fails, corrupted, exchanged;
+    ngx_int_t            rc, failed;
+    ngx_uint_t           i, flags, nworkers, nphases, nphase, ops, pfree, size;
+    ngx_pid_t            pid;
+    ngx_shm_t            shm, ctl_shm;
+    ngx_slab_pool_t     *pool;
+    ngx_stress_ctl_t    *ctl;
+    ngx_stress_class_t   before[NGX_STRESS_CLASSES], after[NGX_STRESS_CLASSES], *cl;
+
+    ngx_pid = getpid();
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    for (i = ngx_pagesize; i >>= 1; ngx_pagesize_shift++) { /* void */ }
+
+    ngx_stress_log.log_level = NGX_LOG_WARN;
+    ngx_stress_cycle.log = &ngx_stress_log;
+    ngx_cycle = &ngx_stress_cycle;
+
+    ngx_memzero(&shm, sizeof(ngx_shm_t));
+
+    shm.size = 64 * 1024 * 1024;
+    shm.name.len = sizeof("stress") - 1;
+    shm.name.data = (u_char *) "stress";
+    shm.log = &ngx_stress_log;
+
+    nworkers = 4;
+    nphases = 8;
+    ops = 200000;
+
+    flags = 0;
+
+    /* the flags go into the zone's header, which is only mapped once the size is known */
+    while ((c = getopt(argc, argv, "w:p:n:z:sfmr")) != -1) {
+        switch (c) {
+
+        case 'w':
+            nworkers = ngx_max(atoi(optarg), 1);
+            break;
+
+        case 'p':
+            nphases = ngx_max(atoi(optarg), 1);
+            break;
+
+        case 'n':
+            ops = ngx_max(atoi(optarg), 1);
+            break;
+
+        case 'z':
+            shm.size = (size_t) ngx_max(atoi(optarg), 1) * 1024 * 1024;
+            break;
+
+        case 's':
+            flags |= 1;
+            break;
+
+        case 'f':
+            flags |= 2;
+            break;
+
+        case 'm':
+            flags |= 4;
+            break;
+
+        case 'r':
+            flags |= 8;
+            break;
+
+        default:
+            ngx_log_error(NGX_LOG_EMERG, &ngx_stress_log, 0,
+                          "usage: %s [-w workers] [-p phases] [-n ops] [-z MB] [-s] [-f] [-m] [-r]", argv[0]);
+            return 1;
+        }
+    }
+
+    if (ngx_pagesize_shift - 3 + 1 > NGX_STRESS_CLASSES) {
+        ngx_log_error(NGX_LOG_EMERG, &ngx_stress_log, 0, "page size %ui is too big", ngx_pagesize);
+        return 1;
+    }
+
+    if (ngx_shm_alloc(&shm) != NGX_OK) {
+        return 1;
+    }
+
+    pool = (ngx_slab_pool_t *) shm.addr;
+    pool->end = shm.addr + shm.size;
+    pool->min_shift = 3;
+    pool->addr = shm.addr;
+
+    pool->striped = (flags & 1) != 0;
+    pool->fine = (flags & 2) != 0;
+    pool->remote = (flags & 8) != 0;
+
+    if (ngx_shmtx_create(&pool->mutex, &pool->lock, NULL) != NGX_OK) {
+        return 1;
+    }
+
+    ngx_slab_sizes_init();
+    ngx_slab_init(pool);
+
+    pool->log_nomem = 0;      /* failures are expected once the zone fills up, they're counted */
+    pool->magazines = (flags & 4) != 0;
+
+    pfree = pool->pfree;
+
+    ngx_memzero(&ctl_shm, sizeof(ngx_shm_t));
+
+    ctl_shm.size = sizeof(ngx_stress_ctl_t) + (nworkers - 1) * sizeof(ngx_stress_worker_t);
+    ctl_shm.name.len = sizeof("stress_ctl") - 1;
+    ctl_shm.name.data = (u_char *) "stress_ctl";
+    ctl_shm.log = &ngx_stress_log;
+
+    if (ngx_shm_alloc(&ctl_shm) != NGX_OK) {
+        return 1;
+    }
+
+    ctl = (ngx_stress_ctl_t *) ctl_shm.addr;
+    ngx_memzero(ctl, ctl_shm.size);
+
+    for (i = 0; i < nworkers; i++) {
+        pid = fork();
+
+        if (pid == -1) {
+            ngx_log_error(NGX_LOG_EMERG, &ngx_stress_log, ngx_errno, "fork() failed");
+            return 1;
+        }
+
+        if (pid == 0) {
+            ngx_pid = getpid();
+            ngx_stress_worker(pool, ctl, i, nphases, ops);
+            /* unreachable */
+        }
+    }
+
+    out = ngx_alloc(NGX_STRESS_OUTPUT, &ngx_stress_log);
+    if (out == NULL) {
+        return 1;
+    }
+
+    p = out;
+    last = out + NGX_STRESS_OUTPUT;
+
+    p = ngx_slprintf(p, last, "{\"workers\":%ui,\"ops\":%ui,\"pages\":%ui,"
+                     "\"striped\":%ui,\"fine\":%ui,\"magazines\":%ui,\"remote\":%ui,\"phases\":[",
+                     nworkers, ops, pfree, (ngx_uint_t) pool->striped,
+                     (ngx_uint_t) (pool->fine_slot < pool->nslots),
+                     (ngx_uint_t) pool->magazines, (ngx_uint_t) pool->remote);
+
+    failed = 0;
+
+    for (nphase = 1; nphase <= nphases; nphase++) {
+        ngx_stress_sum(ctl, nworkers, before);
+
+        ctl->done = 0;
+        ngx_memory_barrier();
+
+        start = ngx_stress_now();
+        ctl->phase = nphase;
+
+        if (ngx_stress_wait(ctl, nworkers) != NGX_OK) {
+            return 1;
+        }
+
+        ms = (ngx_stress_now() - start) / 1000000;
+
+        ngx_stress_sum(ctl, nworkers, after);
+
+        nops = 0;
+        fails = 0;
+
+        for (i = 0; i < NGX_STRESS_CLASSES; i++) {
+            nops += after[i].allocs + after[i].frees + after[i].fails
+                    - before[i].allocs - before[i].frees - before[i].fails;
+            fails += after[i].fails - before[i].fails;
+        }
+
+        /* the workers wait at the barrier, the zone is quiescent */
+
+        if (pool->locks == NULL) {
+            ngx_shmtx_lock(&pool->mutex);
+        }
+
+        rc = ngx_slab_check(pool);
+
+        if (pool->locks == NULL) {
+            ngx_shmtx_unlock(&pool->mutex);
+        }
+
+        failed |= (rc != NGX_OK);
+
+        p = ngx_slprintf(p, last, "%s{\"phase\":\"%s\",\"ms\":%uL,\"ops\":%uL,\"mops\":%.2f,"
+                         "\"fails\":%uL,\"check\":\"%s\",\"free\":%ui}",
+                         nphase == 1 ? "" : ",",
+                         ngx_stress_phases[(nphase - 1) % (sizeof(ngx_stress_phases) / sizeof(ngx_stress_phase_t) - 1)].name,
+                         ms, nops, ms ? (double) nops / ms / 1000 : 0.0, fails,
+                         rc == NGX_OK ? "ok" : "failed", pool->pfree);
+    }
+
+    /* the workers free what they hold and exit */
+
+    ctl->done = 0;
+    ngx_memory_barrier();
+
+    ctl->phase = nphases + 1;
+
+    if (ngx_stress_wait(ctl, nworkers) != NGX_OK) {
+        return 1;
+    }
+
+    while (wait(NULL) > 0) { /* void */ }
+
+    /* an allocation from a slot drains the chunks remotely freed into it, every 8 bytes hit all the slots */
+
+    if (pool->rfree) {
+        if (pool->locks == NULL) {
+            ngx_shmtx_lock(&pool->mutex);
+        }
+
+        for (size = 8; size <= ngx_pagesize / 2; size += 8) {
+            chunk = ngx_slab_alloc_locked(pool, size);
+            if (chunk) {
+                ngx_slab_free_locked(pool, chunk);
+            }
+        }
+
+        if (pool->locks == NULL) {
+            ngx_shmtx_unlock(&pool->mutex);
+        }
+    }
+
+    rc = ngx_slab_check(pool);
+
+    failed |= (rc != NGX_OK) || pool->pfree != pfree;
+
+    ngx_stress_sum(ctl, nworkers, after);
+
+    corrupted = 0;
+    exchanged = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        corrupted += ctl->workers[i].corrupted;
+        exchanged += ctl->workers[i].exchanged;
+    }
+
+    failed |= (corrupted != 0);
+
+    p = ngx_slprintf(p, last, "],\"check\":\"%s\",\"leaked\":%i,\"corrupted\":%uL,\"exchanged\":%uL,\"classes\":[",
+                     rc == NGX_OK ? "ok" : "failed", (ngx_int_t) (pfree - pool->pfree), corrupted, exchanged);
+
+    for (i = 0; i < ngx_pagesize_shift - 3 + 1; i++) {
+        cl = &after[i];
+
+        if (i < ngx_pagesize_shift - 3) {
+            p = ngx_slprintf(p, last, "%s{\"size\":%uz,", i ? "," : "", (size_t) 8 << i);
+
+        } else {
+            p = ngx_slprintf(p, last, ",{\"size\":\"pages\",");
+        }
+
+        p = ngx_slprintf(p, last, "\"allocs\":%uL,\"frees\":%uL,\"fails\":%uL,"
+                         "\"alloc_ns\":%.2f,\"free_ns\":%.2f,\"mops\":%.2f}",
+                         cl->allocs, cl->frees, cl->fails,
+                         cl->allocs + cl->fails ? (double) cl->alloc_ns / (cl->allocs + cl->fails) : 0.0,
+                         cl->frees ? (double) cl->free_ns / cl->frees : 0.0,
+                         cl->alloc_ns + cl->free_ns
+                             ? (double) (cl->allocs + cl->fails + cl->frees) * 1000 / (cl->alloc_ns + cl->free_ns)
+                             : 0.0);
+    }
+
+    p = ngx_slprintf(p, last, "],\"zone\":");
+
+    /* the workers are gone, the lock is only there for the counters' sake */
+
+    if (pool->locks == NULL) {
+        ngx_shmtx_lock(&pool->mutex);
+    }
+
+    p = ngx_slab_stats_json(pool, p, last);
+
+    if (pool->locks == NULL) {
+        ngx_shmtx_unlock(&pool->mutex);
+    }
+
+    p = ngx_slprintf(p, last, "}%N");
+
+    (void) write(STDOUT_FILENO, out, p - out);
+
+    ngx_shm_free(&ctl_shm);
+    ngx_shm_free(&shm);
+
+    return failed ? 1 : 0;
+}
+
+
+static void ngx_stress_worker(ngx_slab_pool_t *pool, ngx_stress_ctl_t *ctl, ngx_uint_t w, ngx_uint_t nphases, ngx_uint_t ops) {
+    ngx_uint_t            i, n, nlive, nphase, mixes;
+    ngx_atomic_uint_t     x;
+    ngx_stress_chunk_t   *live[NGX_STRESS_LIVE], *c;
+    ngx_stress_phase_t   *ph;
+    ngx_stress_worker_t  *wk;
+
+    ngx_stress_seed = 0x9e3779b97f4a7c15 ^ ((uint64_t) ngx_pid << 17);
+
+    wk = &ctl->workers[w];
+    nlive = 0;
+    mixes = sizeof(ngx_stress_phases) / sizeof(ngx_stress_phase_t) - 1;
+
+    for (nphase = 1; /* void */; nphase++) {
+
+        while (ctl->phase != nphase) {
+            ngx_sched_yield();
+        }
+
+        if (nphase > nphases) {
+            break;
+        }
+
+        ph = &ngx_stress_phases[(nphase - 1) % mixes];
+
+        for (n = 0; n < ops; n++) {
+
+            if (ngx_stress_random() % 8 == 0) {
+                /* pick up a chunk another worker gave away */
+                i = ngx_stress_random() % NGX_STRESS_EXCHANGE;
+                x = ctl->exchange[i];
+
+                if (x && ngx_atomic_cmp_set(&ctl->exchange[i], x, 0)) {
+                    wk->exchanged++;
+                    ngx_stress_free(pool, wk, (ngx_stress_chunk_t *) x);
+                    continue;
+                }
+            }
+
+            if (nlive < NGX_STRESS_LIVE && (nlive == 0 || ngx_stress_random() % 100 < ph->allocs)) {
+                ngx_stress_alloc(pool, wk, ph, live, &nlive);
+                continue;
+            }
+
+            i = ngx_stress_random() % nlive;
+            c = live[i];
+            live[i] = live[--nlive];
+
+            if (ngx_stress_random() % 8 == 0) {
+                i = ngx_stress_random() % NGX_STRESS_EXCHANGE;
+
+                if (ngx_atomic_cmp_set(&ctl->exchange[i], 0, (ngx_atomic_uint_t) c)) {
+                    continue;
+                }
+            }
+
+            ngx_stress_free(pool, wk, c);
+        }
+
+        (void) ngx_atomic_fetch_add(&ctl->done, 1);
+    }
+
+    /* free everything, the chunks left in the exchange too */
+
+    for (i = 0; i < NGX_STRESS_EXCHANGE; i++) {
+        x = ctl->exchange[i];
+
+        if (x && ngx_atomic_cmp_set(&ctl->exchange[i], x, 0)) {
+            ngx_stress_free(pool, wk, (ngx_stress_chunk_t *) x);
+        }
+    }
+
+    while (nlive) {
+        ngx_stress_free(pool, wk, live[--nlive]);
+    }
+
+    ngx_slab_magazines_flush();
+
+    (void) ngx_atomic_fetch_add(&ctl->done, 1);
+
+    exit(0);
+}
+
+
+static void ngx_stress_alloc(ngx_slab_pool_t *pool, ngx_stress_worker_t *wk, ngx_stress_phase_t *ph, ngx_stress_chunk_t **live, ngx_uint_t *nlive) {
+    size_t               size;
+    uint64_t             start, ns;
+    ngx_uint_t           shift;
+    ngx_stress_chunk_t  *c;
+
+    /* log-uniform, so every size class gets its share */
+
+    shift = ph->min_shift + ngx_stress_random() % (ph->max_shift - ph->min_shift + 1);
+
+    size = (size_t) 1 << shift;
+
+    if (shift > 3) {
+        size -= ngx_stress_random() % (size / 2);
+    }
+
+    start = ngx_stress_now();
+
+    c = ngx_slab_alloc(pool, size);
+
+    ns = ngx_stress_now() - start;
+
+    if (c == NULL) {
+        wk->classes[ngx_stress_class(size)].fails++;
+        wk->classes[ngx_stress_class(size)].alloc_ns += ns;
+        return;
+    }
+
+    wk->classes[ngx_stress_class(size)].allocs++;
+    wk->classes[ngx_stress_class(size)].alloc_ns += ns;
+
+    c->size = (uint32_t) size;
+    c->tag = (uint32_t) ngx_stress_random();
+
+    if (size > sizeof(ngx_stress_chunk_t)) {
+        ((u_char *) c)[size - 1] = (u_char) c->tag;
+    }
+
+    live[(*nlive)++] = c;
+}
+
+
+static void ngx_stress_free(ngx_slab_pool_t *pool, ngx_stress_worker_t *wk, ngx_stress_chunk_t *c) {
+    size_t    size;
+    uint64_t  start;
+
+    size = c->size;
+
+    if (size < sizeof(ngx_stress_chunk_t) || size > ((size_t) 1 << 14)
+        || (size > sizeof(ngx_stress_chunk_t) && ((u_char *) c)[size - 1] != (u_char) c->tag))
+    {
+        ngx_log_error(NGX_LOG_ALERT, &ngx_stress_log, 0, "chunk %p of %uz bytes is corrupted", c, size);
+        wk->corrupted++;
+        return;   /* leaked, rather than freed twice */
+    }
+
+    c->size = 0;  /* a chunk freed twice shows up as corrupted */
+
+    start = ngx_stress_now();
+
+    ngx_slab_free(pool, c);
+
+    wk->classes[ngx_stress_class(size)].free_ns += ngx_stress_now() - start;
+    wk->classes[ngx_stress_class(size)].frees++;
+}
+
+
+/* power of two classes from 8 bytes up to half a page, then a single class of whole pages */
+static ngx_uint_t ngx_stress_class(size_t size) {
+    ngx_uint_t  n;
+
+    if (size > ngx_pagesize / 2) {
+        return ngx_pagesize_shift - 3;
+    }
+
+    for (n = 0; ((size_t) 8 << n) < size; n++) { /* void */ }
+
+    return n;
+}
+
+
+/* waits for all the workers to finish the phase, fails if any of them died */
+static ngx_int_t ngx_stress_wait(ngx_stress_ctl_t *ctl, ngx_uint_t nworkers) {
+    int        status;
+    ngx_pid_t  pid;
+
+    while (ctl->done < nworkers) {
+        pid = waitpid(-1, &status, WNOHANG);
+
+        if (pid > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            ngx_log_error(NGX_LOG_ALERT, &ngx_stress_log, 0, "worker %P exited with status %d", pid, status);
+            kill(0, SIGKILL);
+            return NGX_ERROR;
+        }
+
+        (void) usleep(1000);
+    }
+
+    return NGX_OK;
+}
+
+
+static void ngx_stress_sum(ngx_stress_ctl_t *ctl, ngx_uint_t nworkers, ngx_stress_class_t *sum) {
+    ngx_uint_t           i, w;
+    ngx_stress_class_t  *cl;
+
+    ngx_memzero(sum, NGX_STRESS_CLASSES * sizeof(ngx_stress_class_t));
+
+    for (w = 0; w < nworkers; w++) {
+        for (i = 0; i < NGX_STRESS_CLASSES; i++) {
+            cl = &ctl->workers[w].classes[i];
+
+            sum[i].allocs += cl->allocs;
+            sum[i].frees += cl->frees;
+            sum[i].fails += cl->fails;
+            sum[i].alloc_ns += cl->alloc_ns;
+            sum[i].free_ns += cl->free_ns;
+        }
+    }
+}
+
+
+static uint64_t ngx_stress_now(void) {
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* xorshift64*, seeded per worker */
+static uint64_t ngx_stress_random(void) {
+    ngx_stress_seed ^= ngx_stress_seed >> 12;
+    ngx_stress_seed ^= ngx_stress_seed << 25;
+    ngx_stress_seed ^= ngx_stress_seed >> 27;
+
+    return ngx_stress_seed * 0x2545f4914f6cdd1d;
+}
@@ -2,6 +2,13 @@
 #include <ngx_core.h>
 
 
+#if (NGX_HAVE_NUMA)
+
+ngx_numa_t  ngx_numa = { -1, 0, 0 };
+
+#endif
+
+
 void *ngx_alloc(size_t size, ngx_log_t *log) {
     void *p;
 
@@ -114,4 +121,211 @@ void *ngx_memalign(size_t alignment, size_t size, ngx_log_t *log) {
     return p;
 }
 
-#endif
\ No newline at end of file
+#endif
+
+
+/**
+ * ngx_alloc_huge maps `size` bytes (a multiple of the huge page size, 2MB on x86-64) 
+ * of private anonymous memory aligned to `size`, meant to be backed by huge pages, 
+ * so that everything carved from it is covered by a single dTLB entry.
+ * 
+ * MAP_HUGETLB takes pages from the preallocated hugetlbfs pool (vm.nr_hugepages), 
+ * such mappings are naturally aligned to the huge page size. If the pool is empty 
+ * or not configured, mmap() fails with ENOMEM and we fall back to regular pages 
+ * with `madvise(MADV_HUGEPAGE)`, asking Transparent Huge Pages to back the range 
+ * with a huge page on first touch (or later on by khugepaged). THP can only do so 
+ * for huge-page-aligned ranges, so twice the size is mapped and trimmed down to an 
+ * aligned range with munmap().
+ * 
+ * `*huge` is set to 1 if the memory comes from the hugetlbfs pool.
+ * Returns NULL if neither can be mapped, callers fall back to the heap.
+ */
+void *ngx_alloc_huge(size_t size, ngx_uint_t *huge, ngx_log_t *log) {
+#if (NGX_HAVE_MAP_ANON)
+    u_char  *p, *a;
+
+#if defined(MAP_HUGETLB)
+
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+
+    if (p != MAP_FAILED) {
+        *huge = 1;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0, "mmap(MAP_HUGETLB): %p:%uz", p, size);
+
+        return p;
+    }
+
+#endif
+
+    *huge = 0;
+
+    p = mmap(NULL, 2 * size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+
+    if (p == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "mmap(MAP_ANON, %uz) failed", 2 * size);
+        return NULL;
+    }
+
+    a = ngx_align_ptr(p, size);
+
+    if (a != p) {
+        (void) munmap(p, a - p);
+    }
+
+    (void) munmap(a + size, (p + size) - a);
+
+#if defined(MADV_HUGEPAGE)
+
+    if (madvise(a, size, MADV_HUGEPAGE) == -1) {
+        ngx_log_error(NGX_LOG_INFO, log, ngx_errno, "madvise(MADV_HUGEPAGE) failed");
+    }
+
+#endif
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0, "mmap(MAP_ANON): %p:%uz", a, size);
+
+    return a;
+
+#else
+
+    return NULL;
+
+#endif
+}
+
+
+void ngx_free_huge(void *p, size_t size, ngx_log_t *log) {
+#if (NGX_HAVE_MAP_ANON)
+
+    if (munmap(p, size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "munmap(%p, %uz) failed", p, size);
+    }
+
+#endif
+}
+
+
+/**
+ * ngx_alloc_purge tells the kernel that the pages fully within [start, end) 
+ * are no longer needed, while keeping them mapped: RSS drops, the next touch 
+ * faults in a fresh page. Partial pages at both ends are left alone, they may 
+ * be shared with memory still in use (e.g. malloc(3) chunk headers). 
+ * 
+ * Works for heap memory as well, as long as the range belongs to the caller. 
+ * Returns the start of the purged range, `end` if there was nothing to purge.
+ */
+u_char *ngx_alloc_purge(u_char *start, u_char *end, ngx_log_t *log) {
+    u_char  *s, *e;
+
+    s = ngx_align_ptr(start, ngx_pagesize);
+    e = (u_char *) ((uintptr_t) end & ~((uintptr_t) ngx_pagesize - 1));
+
+    if (s >= e) {
+        return end;
+    }
+
+#if (NGX_HAVE_MADV_FREE)
+
+    if (madvise(s, e - s, MADV_FREE) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "madvise(%p, %uz, MADV_FREE) failed", s, (size_t) (e - s));
+        return end;
+    }
+
+#else
+
+    if (madvise(s, e - s, MADV_DONTNEED) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "madvise(%p, %uz, MADV_DONTNEED) failed", s, (size_t) (e - s));
+        return end;
+    }
+
+#endif
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0, "purge: %p:%uz", s, (size_t) (e - s));
+
+    return s;
+}
+
+
+
+#if (NGX_HAVE_NUMA)
+
+/**
+ * ngx_numa_init keeps the calling worker's memory on the NUMA node of the CPU 
+ * it runs on, so it's meant to be called by a worker once it has been pinned 
+ * to a CPU (worker_cpu_affinity), otherwise the scheduler may move it to the 
+ * other node anyway and it's better to leave placement to the kernel.
+ * 
+ * The worker's memory policy becomes MPOL_PREFERRED for its node: every page 
+ * faulted in from now on comes from the local node while it has free memory 
+ * (unlike MPOL_BIND, which would rather OOM than go remote). That covers pool 
+ * blocks, buffers and arenas mapped later on, whatever allocator they come from. 
+ * 
+ * Pages inherited from the master (e.g. heap memory freed before fork() and 
+ * handed out again in the worker) aren't moved: they're shared copy-on-write, 
+ * and the first write to one makes a private copy, which is faulted in under 
+ * the worker's policy as well. So nothing is looked up or moved as memory is 
+ * allocated, which keeps system calls off the allocation path altogether; 
+ * only pages the worker never writes to may stay remote. How well that works 
+ * is sampled by `ngx_numa_sample()`.
+ * 
+ * Raw system calls are used, so libnuma isn't needed. The kernel reads one 
+ * bit less of the node mask than `maxnode` says (see get_nodes() in 
+ * mm/mempolicy.c, libnuma passes its mask size + 1 too), so the bits up to 
+ * and including `node` are passed as `node + 2`.
+ */
+ngx_int_t ngx_numa_init(ngx_log_t *log) {
+    unsigned        cpu, node;
+    unsigned long   mask;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "getcpu() failed");
+        return NGX_ERROR;
+    }
+
+    if (node >= sizeof(mask) * 8) {
+        return NGX_DECLINED;
+    }
+
+    mask = 1UL << node;
+
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, (unsigned long) node + 2) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "set_mempolicy(MPOL_PREFERRED, %ui) failed", (ngx_uint_t) node);
+        return NGX_ERROR;
+    }
+
+    ngx_numa.node = node;
+
+    ngx_log_error(NGX_LOG_INFO, log, 0, "numa: cpu %ui, node %ui", (ngx_uint_t) cpu, (ngx_uint_t) node);
+
+    return NGX_OK;
+}
+
+
+/**
+ * ngx_numa_sample counts the page at `p` as local or remote to the worker's 
+ * node, looked up with get_mempolicy(MPOL_F_NODE|MPOL_F_ADDR). That's a 
+ * system call (and faults the page in if it isn't yet), so it's only made 
+ * where memory changes hands in bulk: pool blocks taken from the heap or 
+ * given back to it, and arenas as they're mapped.
+ */
+void ngx_numa_sample(void *p) {
+    int  node;
+
+    if (ngx_numa.node == -1) {
+        return;
+    }
+
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, p, MPOL_F_NODE|MPOL_F_ADDR) == -1) {
+        return;
+    }
+
+    if (node == ngx_numa.node) {
+        ngx_numa.local++;
+
+    } else {
+        ngx_numa.remote++;
+    }
+}
+
+#endif
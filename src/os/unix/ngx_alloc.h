@@ -35,6 +35,45 @@ void *ngx_memalign(size_t alignment, size_t size, ngx_log_t *log);
 #endif
 
 
+void *ngx_alloc_huge(size_t size, ngx_uint_t *huge, ngx_log_t *log);
+void ngx_free_huge(void *p, size_t size, ngx_log_t *log);
+u_char *ngx_alloc_purge(u_char *start, u_char *end, ngx_log_t *log);
+
+
+/*
+ * MADV_FREE (Linux 4.5+) only lets the kernel reclaim pages lazily under
+ * memory pressure, until then they keep their contents. MADV_DONTNEED drops
+ * them right away and private anonymous pages read back as zeroes.
+ */
+#if (NGX_HAVE_MADV_FREE)
+#define NGX_ALLOC_PURGE_ZEROES  0
+#else
+#define NGX_ALLOC_PURGE_ZEROES  1
+#endif
+
+
+#if (NGX_HAVE_NUMA)
+
+/*
+ * Placement of the worker's memory on NUMA machines, see `ngx_numa_init()`.
+ * The counters come from `ngx_numa_sample()`, which the pool allocator calls 
+ * on a share of the blocks it takes and gives back, never per allocation.
+ */
+typedef struct {
+    ngx_int_t   node;    /* node of the CPU the worker is pinned to, -1 if unknown */
+    ngx_uint_t  local;   /* sampled pages found on `node` */
+    ngx_uint_t  remote;  /* sampled pages found on another node */
+} ngx_numa_t;
+
+
+ngx_int_t ngx_numa_init(ngx_log_t *log);
+void ngx_numa_sample(void *p);
+
+extern ngx_numa_t  ngx_numa;
+
+#endif
+
+
 extern ngx_uint_t  ngx_pagesize; /* TODO!!!!! usually physical page size of 4096 bytes (4KB) */
 
 
@@ -9,6 +9,7 @@
 typedef int               ngx_err_t; /* errno from <errno.h> is of type int */
 
 #define NGX_EINTR         EINTR
+#define NGX_EAGAIN        EAGAIN
 
 
 #define ngx_errno                  errno
@@ -26,6 +26,7 @@
 
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/file.h>           /* flock() */
 #include <fcntl.h>
 
 #include <sys/wait.h>
@@ -82,6 +83,19 @@ extern ssize_t sendfile(int s, int fd, int32_t *offset, size_t size);
 
 #include <sys/syscall.h>
 
+/* futex(2) is there since 2.6, the shared mutexes sleep on it instead of a posix semaphore */
+#ifndef NGX_HAVE_FUTEX
+#define NGX_HAVE_FUTEX  1
+#endif
+
+#if (NGX_HAVE_FUTEX)
+#include <linux/futex.h>        /* FUTEX_WAIT, FUTEX_WAKE */
+#endif
+
+#if (NGX_HAVE_NUMA)
+#include <linux/mempolicy.h>    /* MPOL_PREFERRED */
+#endif
+
 #if (NGX_HAVE_FILE_AIO)
 #include <linux/aio_abi.h>
 typedef struct iocb  ngx_aiocb_t;
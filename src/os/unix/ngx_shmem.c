@@ -4,11 +4,43 @@
 
 #if (NGX_HAVE_MAP_ANON)
 
+static ngx_int_t ngx_shm_alloc_file(ngx_shm_t *shm);
+static void ngx_shm_free_file(ngx_shm_t *shm);
+static u_char *ngx_shm_file_base(ngx_shm_t *shm, ngx_fd_t fd);
+static uint32_t ngx_shm_checksum(ngx_shm_header_t *h);
+
+
+/**
+ * A zone with `shm->reserve` set past its size is mapped that big from the 
+ * start, so that it can grow in place on reload (see `ngx_shm_resize()`) 
+ * without moving, the workers' pointers into it stay valid. The reserve is 
+ * mapped readable and writable with MAP_NORESERVE rather than PROT_NONE: 
+ * protection is per process, an mprotect() by the master on reload wouldn't 
+ * reach the old workers, which keep allocating from the zone meanwhile. 
+ * Shared anonymous memory only takes RAM (and swap) once touched, so pages 
+ * past the zone's size cost nothing until the slab allocator hands them out.
+ */
 ngx_int_t ngx_shm_alloc(ngx_shm_t *shm) {
-    shm->addr = (u_char *) mmap(NULL, shm->size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+    int      flags;
+    size_t   size;
+
+    if (shm->file.len) {
+        return ngx_shm_alloc_file(shm);
+    }
+
+    size = ngx_max(shm->size, shm->reserve);
+    flags = MAP_ANON|MAP_SHARED;
+
+#ifdef MAP_NORESERVE
+    if (size > shm->size) {
+        flags |= MAP_NORESERVE;
+    }
+#endif
 
-    if (shm->addr = MAP_FAILED) {
-        ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno, "mmap(MAP_ANON|MAP_SHARED, %uz) failed", shm->size);
+    shm->addr = (u_char *) mmap(NULL, size, PROT_READ|PROT_WRITE, flags, -1, 0);
+
+    if (shm->addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno, "mmap(MAP_ANON|MAP_SHARED, %uz) failed", size);
         return NGX_ERROR;
     }
 
@@ -17,11 +49,325 @@ ngx_int_t ngx_shm_alloc(ngx_shm_t *shm) {
 
 
 void ngx_shm_free(ngx_shm_t *shm) {
-    if (munmap((void *) shm->addr, shm->size) == -1) {
-        ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno, "munmap(%p, %uz) failed", shm->addr, shm->size);
+    size_t  size;
+
+    if (shm->file.len) {
+        ngx_shm_free_file(shm);
+        return;
+    }
+
+    size = ngx_max(shm->size, shm->reserve);
+
+    if (munmap((void *) shm->addr, size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno, "munmap(%p, %uz) failed", shm->addr, size);
     }
 }
 
+
+/**
+ * ngx_shm_resize changes the size of a zone within its reserve. Growing 
+ * takes nothing but the new size, the pages get committed as they're 
+ * touched. Shrinking gives the whole pages past the new size back to the 
+ * kernel with MADV_REMOVE, plain MADV_DONTNEED would only drop them from 
+ * the calling process' page tables and keep them in the shared mapping. 
+ * Shrink the slab pool first (see `ngx_slab_resize()`), it may not give 
+ * up as much.
+ */
+ngx_int_t ngx_shm_resize(ngx_shm_t *shm, size_t size) {
+#ifdef MADV_REMOVE
+    u_char  *start, *end;
+#endif
+
+    if (size > ngx_max(shm->size, shm->reserve)) {
+        ngx_log_error(NGX_LOG_ALERT, shm->log, 0, "shared zone \"%V\" can't grow past its reserve of %uz", &shm->name, shm->reserve);
+        return NGX_ERROR;
+    }
+
+#ifdef MADV_REMOVE
+    if (size < shm->size) {
+        start = ngx_align_ptr(shm->addr + size, ngx_pagesize);
+        end = shm->addr + shm->size;
+
+        if (start < end && madvise(start, end - start, MADV_REMOVE) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno, "madvise(%p, %uz, MADV_REMOVE) failed", start, (size_t) (end - start));
+        }
+    }
+#endif
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, shm->log, 0, "shm resize: \"%V\" %uz -> %uz", &shm->name, shm->size, size);
+
+    shm->size = size;
+
+    return NGX_OK;
+}
+
+/**
+ * ngx_shm_alloc_file maps a zone backed by `shm->file` (on tmpfs to keep 
+ * it in RAM, or on disk), which outlives the processes, so that a zone 
+ * like a cache's key/value store survives a full restart. The slab pool 
+ * and everything in it is full of absolute pointers, so the zone has to 
+ * come back at the very same address: it's mapped at `shm->base` with 
+ * MAP_FIXED_NOREPLACE (Linux 4.17+), which fails rather than clobbering 
+ * whatever is mapped there already, or with the address as a hint on 
+ * older kernels, where we check where it landed. Without `shm->base` the 
+ * address is taken from the header of a zone the file already holds (see 
+ * `ngx_shm_file_base()`); if it can't be had again, the zone is mapped 
+ * anywhere and started afresh. 
+ * 
+ * The file is kept open while mapped and locked with flock(), which is held 
+ * by the open file itself and thus shared with the workers forked later on 
+ * (but not with a binary exec()ed on upgrade, it's opened with O_CLOEXEC). 
+ * A file still mapped by anyone, the running cycle's workers on a reload or 
+ * another instance, can't be locked again, so it's refused rather than 
+ * truncated and initialized under them. The lock goes away with the last 
+ * process which has the file open. 
+ * 
+ * The file starts with a page holding `ngx_shm_header_t`, the zone follows. 
+ * A header with the right magic, version, address, size and layout, an 
+ * intact checksum and without the dirty mark gets `shm->exists` set, the 
+ * owner then reattaches to the zone instead of initializing it (it still 
+ * has to create the zone's mutexes again and set the callbacks). Anything 
+ * else, a zone left dirty by a crash (e.g. with a lock held) included, is 
+ * started afresh. The dirty mark is set as the zone is mapped and cleared 
+ * only by `ngx_shm_sync()` on a clean exit.
+ */
+static ngx_int_t ngx_shm_alloc_file(ngx_shm_t *shm) {
+    int                flags;
+    size_t             size;
+    u_char            *p, *base;
+    ngx_fd_t           fd;
+    ngx_err_t          err;
+    ngx_file_info_t    fi;
+    ngx_shm_header_t  *h;
+
+    size = ngx_pagesize + ngx_max(shm->size, shm->reserve);
+
+    fd = open((const char *) shm->file.data, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, shm->log, ngx_errno, "open(\"%s\") failed", shm->file.data);
+        return NGX_ERROR;
+    }
+
+    if (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+
+        if (ngx_errno == EWOULDBLOCK) {
+            ngx_log_error(NGX_LOG_EMERG, shm->log, 0, "shared zone \"%V\": \"%s\" is already mapped", &shm->name, shm->file.data);
+
+        } else {
+            ngx_log_error(NGX_LOG_EMERG, shm->log, ngx_errno, "flock(\"%s\") failed", shm->file.data);
+        }
+
+        goto failed;
+    }
+
+    if (fstat(fd, &fi) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, shm->log, ngx_errno, "fstat(\"%s\") failed", shm->file.data);
+        goto failed;
+    }
+
+    if ((size_t) fi.st_size != size && ftruncate(fd, size) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, shm->log, ngx_errno, "ftruncate(\"%s\", %uz) failed", shm->file.data, size);
+        goto failed;
+    }
+
+    base = shm->base;
+
+    if (base == NULL && (size_t) fi.st_size == size) {
+        base = ngx_shm_file_base(shm, fd);
+    }
+
+    for ( ;; ) {
+        flags = MAP_SHARED;
+
+#ifdef MAP_FIXED_NOREPLACE
+        if (base) {
+            flags |= MAP_FIXED_NOREPLACE;
+        }
+#endif
+
+        p = mmap(base ? base - ngx_pagesize : NULL, size, PROT_READ|PROT_WRITE, flags, fd, 0);
+
+        if (p != MAP_FAILED && (base == NULL || p + ngx_pagesize == base)) {
+            break;
+        }
+
+        err = (p == MAP_FAILED) ? ngx_errno : 0;
+
+        if (p != MAP_FAILED) {
+            (void) munmap(p, size);
+        }
+
+        if (shm->base == NULL) {
+            /* the address came from the file, the zone there is given up */
+            ngx_log_error(NGX_LOG_WARN, shm->log, err, "shared zone \"%V\": \"%s\" can't be mapped back at %p, starting afresh", 
+                          &shm->name, shm->file.data, base);
+            base = NULL;
+            continue;
+        }
+
+        if (err) {
+            ngx_log_error(NGX_LOG_EMERG, shm->log, err, "mmap(\"%s\", %uz) at %p failed", shm->file.data, size, base);
+
+        } else {
+            ngx_log_error(NGX_LOG_EMERG, shm->log, 0, "\"%s\" mapped at %p instead of %p", shm->file.data, p + ngx_pagesize, base);
+        }
+
+        goto failed;
+    }
+
+    h = (ngx_shm_header_t *) p;
+    shm->addr = p + ngx_pagesize;
+    shm->fd = fd;
+
+    shm->exists = ((size_t) fi.st_size == size
+                   && h->magic == NGX_SHM_MAGIC
+                   && h->version == NGX_SHM_VERSION
+                   && h->base == (uint64_t) (uintptr_t) shm->addr
+                   && h->size == shm->size
+                   && h->layout == shm->layout
+                   && h->checksum == ngx_shm_checksum(h)
+                   && !h->dirty);
+
+    if (!shm->exists && h->magic == NGX_SHM_MAGIC) {
+        ngx_log_error(NGX_LOG_WARN, shm->log, 0, "shared zone \"%V\" in \"%s\" is %s, starting afresh", 
+                      &shm->name, shm->file.data, h->dirty ? "dirty" : "incompatible");
+    }
+
+    h->magic = NGX_SHM_MAGIC;
+    h->version = NGX_SHM_VERSION;
+    h->dirty = 1;
+    h->base = (uint64_t) (uintptr_t) shm->addr;
+    h->size = shm->size;
+    h->layout = shm->layout;
+    h->checksum = ngx_shm_checksum(h);
+
+    return NGX_OK;
+
+failed:
+
+    if (close(fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno, "close(\"%s\") failed", shm->file.data);
+    }
+
+    return NGX_ERROR;
+}
+
+
+/**
+ * Unmapping doesn't clear the dirty mark: a zone dropped by a reload is 
+ * unmapped by the master while the old workers may still write to it. 
+ * The flock() is released once they've exited too.
+ */
+static void ngx_shm_free_file(ngx_shm_t *shm) {
+    u_char  *p;
+    size_t   size;
+
+    p = shm->addr - ngx_pagesize;
+    size = ngx_pagesize + ngx_max(shm->size, shm->reserve);
+
+    if (munmap(p, size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno, "munmap(%p, %uz) failed", p, size);
+    }
+
+    if (close(shm->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno, "close(\"%s\") failed", shm->file.data);
+    }
+}
+
+
+/**
+ * ngx_shm_sync is the master's close-clean hook for file-backed zones, called 
+ * on exit (`ngx_master_process_exit()`) once every worker is gone, as nothing 
+ * unmaps zones then. It writes the zone back and clears the dirty mark, so 
+ * that the next start reattaches to it. 
+ * 
+ * The zone must be consistent, which is the caller's to decide: none of its 
+ * locks held (workers killed mid-allocation are only force-unlocked, see 
+ * `ngx_slab_force_unlock()`) and `ngx_slab_check()` passing. A zone which 
+ * isn't is simply left dirty and started afresh next time. 
+ * 
+ * The zone's pages are synced before the header is, so the clean mark never 
+ * reaches the file ahead of the data it vouches for. Anonymous zones have 
+ * nothing to keep.
+ */
+ngx_int_t ngx_shm_sync(ngx_shm_t *shm) {
+    u_char            *p;
+    size_t             size;
+    ngx_shm_header_t  *h;
+
+    if (shm->file.len == 0) {
+        return NGX_OK;
+    }
+
+    p = shm->addr - ngx_pagesize;
+    size = ngx_max(shm->size, shm->reserve);
+
+    if (msync(shm->addr, size, MS_SYNC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno, "msync(\"%s\") failed", shm->file.data);
+        return NGX_ERROR;
+    }
+
+    h = (ngx_shm_header_t *) p;
+    h->size = shm->size;
+    h->dirty = 0;
+    h->checksum = ngx_shm_checksum(h);
+
+    if (msync(p, ngx_pagesize, MS_SYNC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno, "msync(\"%s\") failed", shm->file.data);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/**
+ * ngx_shm_file_base reads the header of a file-backed zone with pread(), 
+ * before anything is mapped, and gives the address the zone was mapped at 
+ * if it's one `ngx_shm_alloc_file()` would reattach to, NULL otherwise.
+ */
+static u_char *ngx_shm_file_base(ngx_shm_t *shm, ngx_fd_t fd) {
+    ngx_shm_header_t  h;
+
+    if (pread(fd, &h, sizeof(ngx_shm_header_t), 0) != (ssize_t) sizeof(ngx_shm_header_t)) {
+        return NULL;
+    }
+
+    if (h.magic != NGX_SHM_MAGIC
+        || h.version != NGX_SHM_VERSION
+        || h.size != shm->size
+        || h.layout != shm->layout
+        || h.checksum != ngx_shm_checksum(&h)
+        || h.dirty
+        || h.base == 0
+        || h.base % ngx_pagesize)
+    {
+        return NULL;
+    }
+
+    return (u_char *) (uintptr_t) h.base;
+}
+
+
+/* FNV-1a over the header fields before `checksum` */
+static uint32_t ngx_shm_checksum(ngx_shm_header_t *h) {
+    u_char    *p, *last;
+    uint32_t   hash;
+
+    hash = 2166136261u;
+
+    p = (u_char *) h;
+    last = (u_char *) &h->checksum;
+
+    while (p < last) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 #elif (NGX_HAVE_MAP_DEVZERO)
 
 ngx_int_t ngx_shm_alloc(ngx_shm_t *shm) {
@@ -65,6 +411,24 @@ void ngx_shm_free(ngx_shm_t *shm) {
     }
 }
 
+
+/* zones mapped from /dev/zero have no reserve, see the MAP_ANON variant */
+ngx_int_t ngx_shm_resize(ngx_shm_t *shm, size_t size) {
+    if (size == shm->size) {
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_ALERT, shm->log, 0, "shared zone \"%V\" can't be resized", &shm->name);
+
+    return NGX_ERROR;
+}
+
+
+/* zones mapped from /dev/zero aren't kept across restarts */
+ngx_int_t ngx_shm_sync(ngx_shm_t *shm) {
+    return NGX_OK;
+}
+
 #elif (NGX_HAVE_SYSVSHM)
 
 #include <sys/ipc.h>
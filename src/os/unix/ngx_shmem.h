@@ -6,17 +6,43 @@
 #include <ngx_core.h>
 
 
+#define NGX_SHM_MAGIC    0x6e67787a6f6e6531   /* "ngxzone1" */
+#define NGX_SHM_VERSION  1
+
+
+/*
+ * The first page of a file-backed zone, the zone itself follows it.
+ * `checksum` covers the fields before it.
+ */
+typedef struct {
+    uint64_t     magic;
+    uint32_t     version;
+    uint32_t     dirty;    /* set while mapped, cleared by `ngx_shm_sync()` on a clean exit */
+    uint64_t     base;
+    uint64_t     size;
+    uint64_t     layout;
+    uint32_t     checksum;
+} ngx_shm_header_t;
+
+
 typedef struct {
     u_char      *addr;
     size_t       size;
     ngx_str_t    name;
     ngx_log_t   *log;
     ngx_uint_t   exists;   /* unsigned  exists:1;  */
+    size_t       reserve;  /* address space the zone may grow into, see `ngx_shm_resize()` */
+    ngx_str_t    file;     /* null-terminated path to back the zone with, see `ngx_shm_alloc_file()` */
+    u_char      *base;     /* address the file-backed zone is mapped at */
+    ngx_fd_t     fd;       /* the file kept open while mapped, holds its flock() */
+    ngx_uint_t   layout;   /* set by the zone's owner, zones of another layout aren't reattached */
 } ngx_shm_t;
 
 
 ngx_int_t ngx_shm_alloc(ngx_shm_t *shm);
 void ngx_shm_free(ngx_shm_t *shm);
+ngx_int_t ngx_shm_resize(ngx_shm_t *shm, size_t size);
+ngx_int_t ngx_shm_sync(ngx_shm_t *shm);
 
 
 #endif /* _NGX_SHMEM_H_INCLUDED_ */
\ No newline at end of file
@@ -7,7 +7,29 @@
 
 #if (NGX_THREADS)
 
-    /* TODO!!!!! */
+#include <pthread.h>
+
+
+/**
+ * Kernel thread id, unlike pthread_t it's a small integer which shows up 
+ * in ps(1), top(1) and /proc/<pid>/task, so it's the one to log, and it 
+ * is unique system-wide while the thread is alive.
+ */
+#if (NGX_LINUX)
+
+typedef pid_t      ngx_tid_t;
+#define NGX_TID_T_FMT         "%P"
+
+#else
+
+typedef uint64_t   ngx_tid_t;
+#define NGX_TID_T_FMT         "%uL"
+
+#endif
+
+ngx_tid_t ngx_thread_tid(void);
+
+#define ngx_log_tid           ngx_thread_tid()
 
 #else 
 
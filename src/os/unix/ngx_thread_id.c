@@ -0,0 +1,37 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#if (NGX_THREADS)
+
+#if (NGX_LINUX)
+
+/**
+ * Older glibc versions (before 2.30) have no gettid(3) wrapper, so the 
+ * system call is made directly, once per thread: the result is cached in 
+ * a thread-local variable. The cache would survive fork(), while the child's 
+ * thread gets a new id, so it's keyed by `ngx_pid`, which every freshly 
+ * forked process sets anew.
+ */
+static __thread ngx_tid_t  ngx_thread_tid_cached;
+static __thread ngx_pid_t  ngx_thread_tid_pid = -1;  /* never a pid, even before `ngx_pid` is set */
+
+
+ngx_tid_t ngx_thread_tid(void) {
+    if (ngx_thread_tid_pid != ngx_pid) {
+        ngx_thread_tid_cached = syscall(SYS_gettid);
+        ngx_thread_tid_pid = ngx_pid;
+    }
+
+    return ngx_thread_tid_cached;
+}
+
+#else
+
+ngx_tid_t ngx_thread_tid(void) {
+    return (uint64_t) (uintptr_t) pthread_self();
+}
+
+#endif
+
+#endif /* NGX_THREADS */